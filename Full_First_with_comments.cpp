@@ -2,236 +2,125 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>  
+#include "bmp_io.h"
+#include "pipeline.h"
+#include "phase_timer.h"
+#include "perf_counters.h"
 
 int main(int argc, char** argv) {
 
 	printf("|*** Convolution program to get the edges of an image ***|\n");
+	//The convolution kernel is chosen from the instruction sets of the CPU (stencil.h).
+	printf("| Convolution kernel: %s |\n", stencil_kernel_name());
 
 	//Initialization of the time variable to measure the execution of the convolution part. 
 	double time_execution = 0.0;
-	//The clock() function is utilized. The clock() function returns the approximate processor time that is consumed by the program. 
-	clock_t begin = clock();
+	/*
+		The phase timer (phase_timer.h) reads a monotonic clock, so it measures the time that passes and not the 
+		processor time that clock() returns, and it keeps the loading, the grayscale conversion, the convolution 
+		and the writing apart. 
+	*/
+	phase_timer timer;
+	phase_timer_start(&timer);
 
 	/*
-	  Initialization of file pointers to access the image.
-	  Need two pointers in order to open each bmp image. 
-	  The image has been processed to be 100 x 100 and to be a bmp file for easier access to the pixels.
+	  The input image is opened through the shared BMP loader (bmp_io.h). It memory-maps the file 
+	  so the pixels are not read one fread call at a time. The result is written with the batched 
+	  writer from the same header.
 	*/
-	FILE* fpin;
-	FILE* fpout;
+	bmp_image bmp;
+	bmp_writer writer;
 
 	/*
 	  Open the two files. 
 	  For the first we need to just read the data of the image. 
 	  For the second if the file does not exist, then create it to write in it.  
-	  "rb" and "wb" are used to read and write in binary mode. 
+	  Check to se if the files openned correctly. If not then terminate the program.
 	 */
-	fpin = fopen("image.bmp", "rb");
-	fpout = fopen("image_alter.bmp", "wb");
-
-	//Check to se if the files openned correctly. If not then terminate the program.
-	if (fpin == NULL || fpout == NULL) {
-		printf("The files did not open corectly.\nCheck to see if the names are correct\nand if the files are in the file of the executable.\n");
+	if (bmp_open(&bmp, "image.bmp") != 0) {
 		return 0;
 	}
 
 	/*
-		Generic code to read the characteristics of the file.
-		We need this to read the size of the file and get the values to pass them on the second file.
-		Also it is used so that the second file is of the same type as the first. 
+		The loader has read the complete header. We need the sizes of the image and a header for the second file 
+		so that it is of the same type as the first. The height keeps its sign inside the loader, so 
+		bottom-up and top-down images are both read in the correct order.
 	*/
 	unsigned char header[54];
-	fread(header, sizeof(unsigned char), 53, fpin);
-	fwrite(header, sizeof(unsigned char), 54, fpout);
-
-	/*
-		Get the height and width value for the read header. The positions of the sizes are the same each time. 
-		If the header is printed to check the values, the sizes are there for every file needed to open. 
-	*/
-	int width = *(int*)&header[18];
-	int height = abs(*(int*)&header[22]);
-
-	/*
-		Here begins the process to retreive the data and insert them into a 1D array.
-		From the sizes taken the array is created using malloc to dynamically allocate the memory. 
-		The array will have for a 100x100 sizes the capacity of 10.000 integers. 
-		Then a second array is created to get the three values that the bmp image contains for each pixel. 
-		That's because it is an rgb image. Even though the values from the image are integers it is safer to read 
-		them like an unsigned character. So other files are edible too. 
-		After that, a check to see if the malloc allocation was succesfull is required. If not then the program will 
-		terminate.
-	*/
-	int* pixel = (int*)malloc(height * width * sizeof(int));
-	unsigned char pixels[3];
-	int i, j;
-	int pos_counter = 0;
-	if (pixel) {
-		/*
-			Run the iteration in the format of a 2D array. This is not necessary but it helps to have continuity later
-			when we pass the elements to the 2D array. The result is that, we take 3 values from the image for each pixel 
-			and the easiest way to get a logical result is to get the mean of the three elements. And for that to happen 
-			the file is readed with stride 1 and element size 3. After we get the average we insert it into the 1D array.
-			The pos_counter value is used to iterate the 1D file correctly. 
-		*/
-		for (i = 0;i < height;++i) {
-			for (j = 0;j < width;++j) {
-				fread(pixels, 3, 1, fpin);
-				int gray = int((pixels[0] + pixels[1] + pixels[2]) / 3);
-				pixel[pos_counter] = gray;				
-				pos_counter++;
-			}
-		}	
-	}else {
-		printf("Malloc allocation failed. Terminating program...\n");		
+	bmp_output_header(&bmp, header);
+	if (bmp_writer_open(&writer, "image_alter.bmp", header) != 0) {
+		bmp_close(&bmp);
 		return 0;
 	}
-	
-	pos_counter = 0;
-
-	/*
-		Creation of the I 2D array. It has the size of the image. 
-		The malloc allocation for a 2D array is as follows. Firstly create
-		the "rows" of the array that will store pointers (array with 100 elements)
-		If the malloc allocation occurs then proceed with creating the second pointers. 
-		As the malloc is making the rows of I, we check to see of that row is founded 
-		and it is not null. If all goes as planned then pass the values of the 1D array 
-		to the I, which willl be used later for the convolution.
-	
-	*/
-	int** I = (int**)malloc(height * sizeof(int*));
-	if (I) {
-		for (i = 0;i < height;i++) {
-			I[i] = (int*)malloc(width * sizeof(int));
-			if (I[i] != NULL) {
-				for (j = 0;j < width;j++) {
-											
-					I[i][j] = pixel[pos_counter];					
-					pos_counter++;
-				}
-			}else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				return 0;
-			}
-		}
-	}else {
-		printf("Malloc allocation failed. Terminating program...\n");
-		return 0;
-	}
-
-
-	pos_counter = 0;
-
-	/*
-		Deallocate the memory for the 1D array. 
-		Close the conection with the file.	
-	*/
-	free(pixel);
-	fclose(fpin);
+	int height = bmp.height;
 
 	/*
 		Creation of the mask.Normally it is needed to process this maskand get the transposeand reversed version of it.
 		But in this occasion the mask would not change. Also in the convolution equation that was given the H array was used.
 	*/
 	int h[3][3] = { {0,1,0},{1,-4,1},{0,1,0} };
-	int x, y;
 
 	/*
-		Creation of the 2D array to store the data from the convolution of the I and h arrays. 
-		It has the same size as the I array, even though it this is not required as the convolution 
-		will not produce data for all the elements of the I array. The procedure to make the array is the 
-		same sa before. Also it is necessary to initialize the array and fill it with zeros as it is a neutral value. 
+		The image is convoluted in bands of rows and tiles of columns (tiling.h). The sizes come from the 
+		caches of the CPU: a tile fits in the L1 cache and a band of gray and convoluted rows fits in the L2 cache.
 	*/
-	int** A = (int**)malloc(height * sizeof(int*));
-
-	//Check malloc allocation 
-	if (A) {
-		for (x = 0;x < height;x++) {
-			A[x] = (int*)malloc(width * sizeof(int));
-			if (A[x] != NULL) {
-				for (y = 0;y < width;y++) {
-					A[x][y] = 0;
-				}
-			}else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				return 0;
-			}
-		}
-	}else {
-		printf("Malloc allocation failed. Terminating program...\n");
-		return 0;
-	}
+	tile_plan plan;
+	tiling_plan(&plan, bmp.width);
+	printf("| Tiles: %d columns, bands: %d rows (L1 %ld KB, L2 %ld KB) |\n", plan.tile_cols, plan.band_rows, plan.l1_bytes / 1024, plan.l2_bytes / 1024);
+	phase_timer_lap(&timer, PHASE_LOAD);
 
 	/*
-		Here the convolution part begins. 
-		It starts in the second row and second column of the I array and ends at the second to last 
-		row/column. The reasoning, is that the process of convolution uses the elements of the array thar 
-		surround the value that is being convoluted. That means that the iteration will fail in other circumstances, 
-		as we get out of the boundaries for I. Henceforth a segmentation fault will pop up. 
-		The above situation actually helps the image processing, because the value of the edges are turned into zeros 
-		and basically are ignored. 
-	
+		Here the convolution part begins. It runs as a single streaming pass (pipeline.h) instead of 
+		separate passes to read the image into I, fill A with zeros, convolve, clamp and write.
+		Every band of rows of the file is turned into gray values, convoluted tile by tile along the rows by 
+		the kernel in stencil.h, which only computes the five non-zero taps of the mask and turns the negative 
+		results to zero, and it is immediately copied three times for every pixel into the batch of the writer, 
+		while it is still in the cache. 
+		The convolution starts in the second row and second column and ends at the second to last 
+		row/column, because it uses the elements that surround the value that is being convoluted. 
+		The edges are zeros and basically are ignored. As there are no I and A arrays of the size 
+		of the image anymore, the memory that is needed only grows with the width of the image.
+		The time of every band is split between the grayscale, convolve and write phases of the timer.
+		With STENCIL_PERF=1 the hardware counters of the processor count the convolution of the bands 
+		(perf_counters.h), and the instructions per cycle, the cache miss rates and the bytes of memory 
+		traffic per pixel are printed next to the time.
 	*/
-	for (x = 1;x < height - 1;x++) {
-		for (y = 1;y < width - 1;y++) {
-			//This part is given in the excersice report.
-			for (i = -1;i < 2;i++) {
-				for (j = -1;j < 2;j++) {
-					//The equation was also given and for this question was not changed. 
-					A[y][x] += h[j + 1][i + 1] * I[y - j][x - i];
-				}
-			}
-		}
+	perf_counters counters;
+	int perf = perf_counters_requested();
+	if (perf) {
+		perf_counters_open(&counters);
+		perf_counters_reset(&counters);
 	}
-		
-
-	/*
-		The I array is not demanded anymore so deallocate the 2D array. 
-		First each column and then each row. 	
-	*/
-	for (i = 0;i < height;i++) {
-		free(I[i]);
-	}free(I);
-
-
-	//Check to see if the convolution produced any negative results and turn them to zero.
-	for (x = 0;x < height;x++) {
-		for (y = 0;y < width;y++) {
-			if (A[x][y] < 0) {
-				A[x][y] = 0;
-			}
-		}
-	}
-	/*
-		To return the values to the second file it is very important to 
-		retain the format of the three values for every pixel / position of 
-		the file. So we use putc function to insert a single element to the position. 
-		Run the iteration for the whole A array, where the edges are zero.
-		Therefore three consecutive putc calls are used. 
-	*/
-	for (i = 0;i < height;i++) {
-		for (j = 0;j < width;j++) {
-			putc(A[i][j], fpout);
-			putc(A[i][j], fpout);
-			putc(A[i][j], fpout);
-		}
+	if (pipeline_run(&bmp, &writer, h, 0, height, &plan, &timer, perf ? &counters : NULL) != 0) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		bmp_close(&bmp);
+		return 0;
 	}
 
-	//Get finish time
-	clock_t end = clock();
-	
-	//Calculate the execution time.To get the number of seconds used by the CPU, we will need to divide by CLOCKS_PER_SEC.
-	//CLOCKS_PER_SEC is defined to be one million in <time. h>
-	time_execution += (double)(end - begin) / CLOCKS_PER_SEC;
+	//Close the conection with the input file.
+	bmp_close(&bmp);
+
+	//Calculate the execution time in seconds from the start of the timer.
+	time_execution += phase_now() - timer.begin;
 	printf("\t|Time of Execution is %f|\n", time_execution);
+	if (perf) {
+		long long values[PERF_COUNTERS];
+		perf_counters_read(&counters, values);
+		perf_counters_close(&counters);
+		perf_counters_print("process", 0, values, (long long)(bmp.width - 2) * (height - 2));
+	}
 
-	//Deallocate the A 2D array just like the I array. 
-	for (i = 0;i < height;i++) {
-		free(A[i]);
-	}free(A);
+	//Write the last batch and close the connection with the second file. 
+	if (bmp_writer_close(&writer) != 0) {
+		printf("Writing the result file failed.\n");
+	}
+	phase_timer_lap(&timer, PHASE_WRITE);
 
-	//Close the connection with the second file. 
-	fclose(fpout);
+	//The times of the phases as one line of JSON.
+	phase_timer_stop(&timer);
+	phase_stats stats;
+	phase_stats_from_timer(&stats, &timer);
+	phase_stats_json(&stats, "serial", bmp.width, height, 1, 1);
 
 	printf("|*** Program finished.To see the result open the file used to write the convoluted data. ***|\n");
 	return 0;
@@ -1,1006 +1,505 @@
 #define _CRT_SECURE_NO_WARNINGS 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <mpi.h>
+#include "bmp_io.h"
+#include "image_buffer.h"
+#include "stencil.h"
+#include "partition.h"
+#include "tiling.h"
+#include "affinity.h"
+#include "phase_timer.h"
+#include "perf_counters.h"
+
+/*
+	Compiled with OpenMP (mpicxx -fopenmp) every process runs a team of threads on its block, the hybrid 
+	mode. Without it these stand-ins make every process run a single thread through the same code, and 
+	OMP_PRAGMA drops the directives instead of leaving them to the compiler as unknown pragmas.
+*/
+#ifdef _OPENMP
+#include <omp.h>
+#define OMP_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#else
+#define OMP_PRAGMA(...)
+static int omp_get_thread_num(void) { return 0; }
+static int omp_get_num_threads(void) { return 1; }
+static int omp_get_max_threads(void) { return 1; }
+static void omp_set_num_threads(int) {}
+#endif
 
 int main(int argc, char** argv) {
 
 
 	//Initialize the basic varriables to be used from all threads.
 	double wtime = 0.0;
-	int i, j, x, y;
-	int id, p, ierr;
-	unsigned char header[54] = { NULL };
+	int i;
+	int id, p, ierr, provided;
+	unsigned char header[54] = { 0 };
 
-	//Initialize width and height with the sizes of the image and the necessary counters.
-	int width = 100, height = 100;
-	int pos_counter = 0;
-	int position = 0;
+	//Initialize width and height, they get the sizes of the image from process 0.
+	int width = 0, height = 0;
 
 	//Initialize the main arrays to be used in the program.
-	int* pixel_zeros = NULL;
-	int** I = NULL;
-	int** A = NULL;
+	unsigned char* pixel_zeros = NULL;
+	image_buffer I;
+	image_buffer A;
 	const int master = 0;
 
-	//Array to be used for the MPI_Gather function to collect the part from each process.
-	int* gather = NULL;
+	//Result image in the shared window, when the processes share one.
+	short* result = NULL;
 
 	/*
 		Check to see if the INIT function is normally executed.
 		If MPI INIT returns 1 then the initialization has failed.
 		For that to occur, maybe something went wrong with the processes
 		or the accountants given from the command line.
+		The threads of the hybrid mode never call MPI themselves, only the main thread of a process 
+		does (MPI_THREAD_FUNNELED). If the library cannot even promise that, every process runs one thread.
 	*/
-	ierr = MPI_Init(&argc, &argv);
+	ierr = MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
 	if (ierr) {
 		printf("Mpi Initialization failed. Exit program\n");
 		MPI_Finalize();
 		exit(1);
 	}
 
-	//Get the id for each process. 
-	MPI_Comm_rank(MPI_COMM_WORLD, &id);
 	//Get the total number of processes that will be used. 
 	MPI_Comm_size(MPI_COMM_WORLD, &p);
 
-
-	/*
-		Because a 100 x 100 image cannot be divided by 8 or 16 and produce a X x 100 array
-		the technique of padding is implemented. Basically, we add a number of rows to the array
-		that will store, for the convolution, the elements from the image. The critical point is to share the
-		added rows evenly top to bottom. So for example if we add 4 rows, two of them will be at the top
-		and the rest will be at the bottom. For padding to be made for 8 and 16 processes, p - 4 is the value
-		of the added rows that will be added. E.g. for 8 it's 4 and for 16 it's 12.
-	*/
-	int padding = height * width + ((p - 4) * height);
-
-	/*
-		Check the number of processes given by the user. If the argument for processe is more than 16
-		or it is an odd number then the program will exit immediately.
-	*/
-	if ((p % 2 != 0) || p > 16) {
-		printf("Program cannot execute unless an even number of processes is given\n");
-		MPI_Finalize();
-		return 0;
-	}
+	//Get the id for each process. 
+	MPI_Comm_rank(MPI_COMM_WORLD, &id);
 
 	//Print a welcoming message. This will not necessarily be the first line in the output.
+	//The convolution kernel is chosen from the instruction sets of the CPU (stencil.h), every process makes the same choice.
+	//It is chosen before the threads start, so they do not race on the choice.
+	const char* kernel_name = stencil_kernel_name();
 	if (id == 0) {
 		printf("|*** Convolution MPI program to get the edges of an image with parallelism ***|\n");
+		printf("| Convolution kernel: %s |\n", kernel_name);
 	}
 
 	//Get start time of execution for each process.
 	wtime = MPI_Wtime();
 
-	//Pointers for opening the image file and saving it in another file.
-	FILE* fpin;
-	FILE* fpout;
-
-	//Synchroniize the processes to mostly wait whiile the first process gets & creates the compartments. 
-	MPI_Barrier(MPI_COMM_WORLD);
+	/*
+		Every process also times the phases of its run with a monotonic clock (phase_timer.h): loading its 
+		part of the file, the grayscale conversion, the decomposition into blocks, the halo exchange (the 
+		time it really waits for it), the convolution and the writing. In the end process 0 gets the minimum, 
+		the mean and the maximum of every phase over all the processes.
+	*/
+	phase_timer timer;
+	phase_timer_start(&timer);
 
-	//Work for the first process with id -> 0
+	/*
+		Only process 0 opens the file to check it and read its header through the shared BMP loader 
+		(bmp_io.h). The pixels are not read here, every process reads its own part of them later with 
+		MPI-IO. So process 0 passes on where the pixels are: the sizes of the image, the bytes of a pixel, 
+		the orientation of the rows, the offset of the first stored row and the bytes of a stored row. 
+		The header for the second file, which also keeps the orientation of the rows, is made here for 
+		the writing part.
+	*/
+	int layout[6] = { 0, 0, 0, 0, 0, 0 };
 	if (id == 0) {
-
-		//Open the File and read from it. Again use of "rb" to read in binary mode. Check to see if it was openned correctly
-
-		fpin = fopen("image.bmp", "rb");
-		if (fpin == NULL) {
-			printf("Cannot Open File.Check if file is in the same directory as the program exe.\n");
-			MPI_Finalize();
-			return 0;
+		bmp_image bmp;
+		if (bmp_open(&bmp, "image.bmp") == 0) {
+			bmp_output_header(&bmp, header);
+			layout[0] = bmp.width;
+			layout[1] = bmp.height;
+			layout[2] = bmp.bytes_per_pixel;
+			layout[3] = bmp.top_down;
+			layout[4] = (int)(bmp.pixels - bmp.map);
+			layout[5] = (int)bmp.row_stride;
+			bmp_close(&bmp);
 		}
+	}
 
-		//Read the elements that contain the characteristics of the file in order to get the sizes.
-		fread(header, sizeof(unsigned char), 53, fpin);
-
-		/*
-			Even though the heightand width are initialiazed in the future this will help the program
-			to get the correct sizes in other images. The key here is for the 0 process to return and send
-			these parts to the rest of the processes with send.
-		*/
-		width = *(int*)&header[18];
-		height = abs(*(int*)&header[22]);
-
-		//Here we create the 1D array to insert the elements from the file.
-		int* pixel = (int*)malloc(sizeof(int) * height * width);
+	/*
+		The image can have any width and height, the rows of the arrays are always width elements 
+		long and there are height of them. If the file could not be opened the sizes stay zero and all the 
+		processes stop together instead of waiting for process 0 forever.
+	*/
+	MPI_Bcast(layout, 6, MPI_INT, master, MPI_COMM_WORLD);
+	phase_timer_lap(&timer, PHASE_LOAD);
+	width = layout[0];
+	height = layout[1];
+	int bytes_per_pixel = layout[2];
+	int top_down = layout[3];
+	MPI_Offset data_offset = layout[4];
+	MPI_Offset row_stride = layout[5];
+	if (width <= 0 || height <= 0) {
+		MPI_Finalize();
+		return 0;
+	}
 
-		/*
-			Just like the previous excercise we initialize an array
-			to read the 3 values for each pixel. If the malloc allocation was succesful
-			we read each elements with stride 1 and size 3. We then calculate
-			the average value of the three rgb values for every pixel.After,
-			store the value from the image into 1D array.
-		*/
-		unsigned char pixels[3];
-		if (pixel) {
-			for (i = 0; i < height;i++) {
-				for (j = 0; j < width; j++) {
-					fread(pixels, 3, 1, fpin);
-					unsigned char gray = (pixels[0] + pixels[1] + pixels[2]) / 3;
-					pixel[pos_counter] = (int)gray;
-					pos_counter++;
-				}
-			}
-		}
-		else {
-			printf("Malloc allocation failed. Terminating program...\n");
-			MPI_Finalize();
-			return 0;
+	/*
+		The processes are arranged in a 2D grid with MPI_Cart_create, so every process owns a block of the 
+		image instead of a strip of whole rows. The halo of a block is its perimeter, so the rows and columns 
+		a process sends shrink as p grows, while with strips every process sends two rows of the full width. 
+		MPI_Dims_create picks the most square grid for p. The longer side of the grid goes along the longer 
+		side of the image, so the blocks are as square as possible. Every block needs at least one row and 
+		one column, so if the image is too thin for the grid the processes are put in a single line. 
+		MPI_Cart_shift gives the neighbours above, below, left and right. The blocks at the edges of the image 
+		have nothing on that side, so their neighbour is MPI_PROC_NULL. Sending to or receiving from 
+		MPI_PROC_NULL does nothing, so every process runs the same code no matter where its block is. Process 0 
+		has read the header and writes it again, so MPI keeps the numbering of the processes (no reorder).
+	*/
+	int dims[2] = { 0, 0 };
+	int periods[2] = { 0, 0 };
+	MPI_Dims_create(p, 2, dims);
+	if ((width > height) != (dims[1] > dims[0])) {
+		int swap = dims[0];
+		dims[0] = dims[1];
+		dims[1] = swap;
+	}
+	if (dims[0] > height || dims[1] > width) {
+		dims[0] = p <= height ? p : 1;
+		dims[1] = p <= height ? 1 : p;
+	}
+	if (dims[0] > height || dims[1] > width) {
+		if (id == 0) {
+			printf("Program cannot execute with more processes (%d) than rows or columns of the image (%d x %d)\n", p, width, height);
 		}
+		MPI_Finalize();
+		return 0;
+	}
 
-		/*
-			The padding part is executed here. If the given number of processe is 8 or 16
-			accordingly, where we create a bigger than usually 1D array to insert the information
-			from the image. However store it in a way, that these elements are stored after the added rows.
-			In the case, where for some reason the added rows were deleted the remaining array would
-			be edible to recreate the full picture for less processes though. At last we initialize the pixel_zeros
-			array with zeros, and then we run the iteration, again in the format of a 2D array. As mentioned before
-			for the first and last couple of rows, leave them as they are (full of zeros), to then normally pass
-			the values to the pixel_zeros.
-			E.g. For 8 processes the rows are 4 and so two rows at the top and two at the bottom. In other words
-			ignore 200 elements in the beginning and another 200 elements before finishing.
-		*/
-		if (p == 8 || p == 16) {
-			pixel_zeros = (int*)malloc(sizeof(int) * padding);
-			if (pixel_zeros) {
-				pos_counter = 0;
-				position = 0;
-				for (i = 0;i < height + (p-4);i++) {
-					for (j = 0;j < width;j++) {
-						pixel_zeros[position] = 0;
-						position++;
-					}
-				}
-				position = 0;
-				for (i = 0;i < height + (p - 4);i++) {
-					for (j = 0;j < width;j++) {
-						position++;
-						//Ignore the elements ouside the if statement.
-						if (position >= (height * ((p - 4) / 2)) && position < ((height * ((p - 4) / 2)) + (height * width))) {
-							pixel_zeros[position] = pixel[pos_counter];
-							pos_counter++;
-						}
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				In the case where p is less than 8 then padding is not needed. Therefore just like in the
-				first question. Create the 1D array to store the information. Maybe this step is not needed
-				because we just pass the values from a 1D array to another 1D but it is safer for continuity
-				purposes.
-			*/
-		}
-		else {
-			pixel_zeros = (int*)malloc(sizeof(int) * height * width);
-			pos_counter = 0;
-			if (pixel_zeros) {
-				pos_counter = 0;
-				for (i = 0; i < height;i++) {
-					for (j = 0;j < width;j++) {
-						pixel_zeros[pos_counter] = pixel[pos_counter];
-						pos_counter++;
-					}
-				}
+	MPI_Comm grid;
+	int coords[2];
+	int up, down, left, right;
+	MPI_Cart_create(MPI_COMM_WORLD, 2, dims, periods, 0, &grid);
+	MPI_Cart_coords(grid, id, 2, coords);
+	MPI_Cart_shift(grid, 0, 1, &up, &down);
+	MPI_Cart_shift(grid, 1, 1, &left, &right);
 
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
+	/*
+		The corners of the halo come from the diagonal neighbours. They are not given by MPI_Cart_shift, 
+		so they are found from the coordinates, and they are MPI_PROC_NULL outside of the grid.
+	*/
+	int corner[4];
+	for (i = 0; i < 4; i++) {
+		int c[2] = { coords[0] + (i < 2 ? -1 : 1), coords[1] + (i % 2 == 0 ? -1 : 1) };
+		corner[i] = MPI_PROC_NULL;
+		if (c[0] >= 0 && c[0] < dims[0] && c[1] >= 0 && c[1] < dims[1]) {
+			MPI_Cart_rank(grid, c, &corner[i]);
 		}
-
-		/*
-			After the interchanging of the values is done then free the allocated space
-			for the pixel array, bring the counters to zero and close the connection to the read file.
-		*/
-		pos_counter = 0;
-		position = 0;
-		free(pixel);
-		fclose(fpin);
-		printf("| Succesfully preprocessed the image elements. |\n");
 	}
 
-	//After the 0 process is completed, synchronize the processes
-	MPI_Barrier(MPI_COMM_WORLD);
-
 	/*
-		First and foremost, recreate the mask to be multiplied fro the convolution part.
-		Make two variables to be used in order to set the boundaries for the scatter. What this means
-		is, that with the MPI_Scatter Function the complete array will be separated to equal subarrays.
-		It is therefore crucial to set the amount of values that each subarray will contain. This is the
-		size to be sent variable. The sub_height variable is the count of rows that each subarray will be
-		later created with. Of course, for the 8, 16 cases the added rows are included to not comprimise
-		the iterations and the 2D arrays.
+		When all the processes run on the same node they can share memory. In that case process 0 allocates 
+		one shared window (MPI_Win_allocate_shared) with the gray image and the result image, and every process 
+		works straight on its block of them: it stores the gray values of its block there and reads the pixels 
+		around it where its neighbours stored them, so no halo is exchanged. Otherwise the halo is sent with 
+		derived datatypes as below. MPI_Comm_split_type finds the processes that share the node, key 0 keeps 
+		process 0 first.
 	*/
-	int h[3][3] = { {0,1,0},{1,-4,1},{0,1,0} };
-	int size_to_be_sent = 0;
-	int sub_height = 0;
+	MPI_Comm node;
+	int node_size;
+	MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+	MPI_Comm_size(node, &node_size);
+	int shared = node_size == p;
 
-	if (p == 8 || p == 16) {
-		size_to_be_sent = padding / p;
-		sub_height = (int)(size_to_be_sent / height);
+	/*
+		Hybrid mode. Every process convolutes its block with a team of OpenMP threads, so for the same count 
+		of cores there are fewer processes, fewer blocks and fewer halo messages. The best layout is one 
+		process per NUMA domain (mpirun --map-by numa --bind-to numa) with a thread for every core of it. The 
+		team gets a thread for every core the process is bound to, unless OMP_NUM_THREADS says otherwise. 
+		Processes of a node can be allowed on the same cores: they are not bound at all, they are bound to the 
+		same NUMA domain or socket (the default of mpirun for more than two processes), or taskset or a cgroup 
+		limits the whole job. Their threads would pile up on the first cores, so the processes of a node with 
+		the same list of cores share it out in the order of their ranks. Every thread is pinned to one core of 
+		its share (affinity.h), unless OMP_PROC_BIND or OMP_PLACES is set, then the OpenMP runtime pins the 
+		threads as they say, like in the OpenMP program. Without OpenMP a process runs a single thread and is 
+		not pinned, the scheduler places it on the cores it may use. 
+	*/
+	int cpus[AFFINITY_MAX_CPUS];
+	int cpu_total = affinity_cpus(cpus, AFFINITY_MAX_CPUS);
+	int cpu_count = cpu_total;
+	int cpu_first = 0;
+	//The processes with the same cores are found by a hash of their list of cores (FNV-1a).
+	unsigned int cpu_hash = 2166136261u;
+	for (i = 0; i < cpu_total; i++) {
+		cpu_hash = (cpu_hash ^ (unsigned int)cpus[i]) * 16777619u;
 	}
-	else {
-		size_to_be_sent = (height * width) / p;
-		sub_height = (int)(size_to_be_sent / height);
+	MPI_Comm same_cpus;
+	int same_size, same_id;
+	MPI_Comm_split(node, (int)(cpu_hash & 0x7FFFFFFF), id, &same_cpus);
+	MPI_Comm_size(same_cpus, &same_size);
+	MPI_Comm_rank(same_cpus, &same_id);
+	MPI_Comm_free(&same_cpus);
+	if (same_size > 1 && cpu_total > 0) {
+		cpu_count = cpu_total / same_size > 0 ? cpu_total / same_size : 1;
+		cpu_first = same_id * cpu_count % cpu_total;
+	}
+	if (provided < MPI_THREAD_FUNNELED) {
+		omp_set_num_threads(1);
+	}
+	else if (getenv("OMP_NUM_THREADS") == NULL && cpu_count > 0) {
+		omp_set_num_threads(cpu_count);
+	}
+	int threads = omp_get_max_threads();
+#ifdef _OPENMP
+	int runtime_bind = getenv("OMP_PROC_BIND") != NULL || getenv("OMP_PLACES") != NULL;
+	if (cpu_count > 0 && !runtime_bind) {
+#pragma omp parallel
+		affinity_pin(cpus[(cpu_first + omp_get_thread_num() % cpu_count) % cpu_total]);
+	}
+#else
+	(void)cpu_first;
+#endif
+	MPI_Win window = MPI_WIN_NULL;
+	size_t gray_bytes = image_round_up((size_t)height * width, IMAGE_ALIGN);
+	if (shared) {
+		unsigned char* base = NULL;
+		MPI_Aint window_size = (id == 0) ? (MPI_Aint)(gray_bytes + sizeof(short) * height * width) : 0;
+		MPI_Aint query_size;
+		int disp_unit;
+		MPI_Win_allocate_shared(window_size, 1, MPI_INFO_NULL, node, &base, &window);
+		MPI_Win_shared_query(window, 0, &query_size, &disp_unit, &base);
+		pixel_zeros = base;
+		result = (short*)(base + gray_bytes);
 	}
 
-	//Creation of the subarray to collect the corresponding part from the main pixel_zeros array.
-	int* subarray = (int*)malloc(sizeof(int) * size_to_be_sent);
-	if (!subarray) {
-		printf("Malloc allocation failed. Terminating program...\n");
-		MPI_Finalize();
-		return 0;
+	if (id == 0) {
+		printf("| Process grid: %d x %d blocks, %d threads per process%s |\n", dims[0], dims[1], threads, shared ? ", shared memory window" : "");
 	}
 
 	/*
-		MPI_Scatter() is used to, as the name suggests, scatter the main array to corresponding sub arrays
-		in order every thread to get a same portion. For example, for p = 4 every subarray counts 2500 elements
-		As a result, they will have 25 rows each. This applies in all the cases with the slight complication
-		of the padding execution.
+		First and foremost, recreate the mask to be multiplied fro the convolution part.
+		The rows of the image are split between the rows of the grid and the columns between the columns 
+		of the grid. When the grid does not divide the image, the first blocks get one row or column more 
+		than the rest (partition.h). The block of this process is the rows [row_begin, row_end) and the 
+		columns [col_begin, col_end), sub_height x sub_width elements.
 	*/
-	MPI_Scatter(pixel_zeros, size_to_be_sent, MPI_INT, subarray, size_to_be_sent, MPI_INT, master, MPI_COMM_WORLD);
+	int h[3][3] = { {0,1,0},{1,-4,1},{0,1,0} };
+	int row_begin, row_end, col_begin, col_end;
+	partition_block(height, dims[0], coords[0], &row_begin, &row_end);
+	partition_block(width, dims[1], coords[1], &col_begin, &col_end);
+	int sub_height = row_end - row_begin;
+	int sub_width = col_end - col_begin;
 
 	/*
-		In this part of the code two illustration are provided.The reasoning is that in the later stages of the program
-		many sendand receives are bound to be executed.For p = 2 processes, we send from the first to the second
-		process the part of this will be discused afterwards. For p>2 the in-between processes have to execute more
-		send & receive requests. It is important to note that all these sent and received elements that one process sents
-		to the other, are ignored during the convolution part.
+		With the shared window the I and A arrays of a process are views of its block in the two images 
+		(image_wrap), so the rows and columns around the block are the real pixels of the neighbours.
 	*/
-	if (p == 2) {
-
-		//MPI_Status is necessary for the Recv function.
-		MPI_Status status;
-
+	MPI_Datatype column8 = MPI_DATATYPE_NULL;
+	MPI_Request requests[16];
+	int request_count = 0;
+	int tag = 1;
+	if (shared) {
+		image_wrap(&I, pixel_zeros + (size_t)row_begin * width + col_begin, sub_width, sub_height, width, 1);
+		image_wrap(&A, result + (size_t)row_begin * width + col_begin, sub_width, sub_height, sizeof(short) * width, 2);
+	}
+	else {
 		/*
-			Divide the program based on the id also known as the subarrays.
-			For the instance of id = 0, create the aforementioned 2D array.
-			This will store the values of the subarray but it is important to notice that
-			it is made with one additional row. The thought process is this:
-			Id(0) will sent the last 100 elements to the next id. The convolution part requires this and
-			explanation is continuity. Suppose we did not send them, convolution would produce different results
-			in the separation line. And even more difficult to handle would be the fact that which row is the
-			correct one to keep and eventually save to the file. Only with scatter the image cannot be convoluted.
+			The I array holds the block of this process with one extra row and column around it (the halo of 
+			image_buffer.h), so row -1 is the last row of the block above, column -1 the last column of the block 
+			on the left and so on. Where there is no neighbour these rows and columns stay zero. The A array for 
+			the convolution has the block of this process only. Check allocations.
+			A column of the halo is a vector of sub_height elements, one in every row of I, so MPI reads and 
+			writes it in place and nothing is copied into temporary arrays.
 		*/
-		if (id == 0) {
-			//Create array with additional row. Check for malloc allocation both times.
-			I = (int**)malloc(sizeof(int*) * (sub_height + 1));
-			if (I) {
-				for (i = 0; i <= sub_height; i++) {
-					I[i] = (int*)malloc(sizeof(int) * height);
-					if (I[i] != NULL) {
-						for (j = 0; j < height; j++) {
-							I[i][j] = 0;
-							position++;
-						}
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				After the initialization of the I array and filling it with zeros, we pass the scatter elements
-				into it. The count, again, varies for the different p. The logic here is to fill all but the last rows.
-				e.g for p = 2 subarray has 5000 elements. The I can hold up to 5100 elements. Therefore the 5000 elements are stored
-				leaving the last row empty and ready to get the 100 elements from the next process.
-			*/
-			for (i = 0; i < sub_height;i++) {
-				for (j = 0; j < height; j++) {
-					I[i][j] = subarray[pos_counter];
-					pos_counter++;
-
-				}
-			}
-
-			/*
-				This part is used to retreive the last 100 elements that came with the subarray, create a 1D
-				array to put them into and then send this to the next process. The position initialized to
-				start from the 5000 - 100 = 4900 position and give the values to the lastelems array.
-			*/
-			position = size_to_be_sent - height;
-			pos_counter = 0;
-			int* lastelems = (int*)malloc(sizeof(int) * height);
-			if (lastelems) {
-				for (j = 0; j < height; j++) {
-					lastelems[j] = subarray[position];
-					position++;
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			position = 0;
-
-			/*
-				The lastelems now holds the 100 last values of the subarray. The height variable is almost always
-				used for future implemantations. Here the height is 100. With the MPI_Send function we send the
-				compartments of the lastelems array to the next process.
-			*/
-			MPI_Send(lastelems, height, MPI_INT, id + 1, 1, MPI_COMM_WORLD);
-
-			//Not necessary but it is good practice to neutrilize the lastelems array that will receive the 100 elements. 
-			for (j = 0; j < height; j++) {
-				lastelems[j] = 0;
-			}
-
-			/*
-				The next process will send back its first 100 subarray elements, which in turn
-				will be the last I elements of this process. That is why after receiving them
-				immediately pass the to the I array.
-			*/
-			MPI_Recv(lastelems, height, MPI_INT, id + 1, 1, MPI_COMM_WORLD, &status);
-			for (j = 0;j < height;j++) {
-				I[sub_height][j] = lastelems[j];
-			}
-
-			//Deallocate the memory for the lastelems 1D array
-			free(lastelems);
-			printf("|Finished preparing and sending data for process %d|\n", id);
-			/*
-				After all that the I array is ready to be convoluted providing continuity
-				and the correct values for the A. It is important to note that in the MPI
-				every process has each own memory part and that is highly noticable when
-				this process goes straight for the convolution having each unique part of
-				the subarray and at last its unique convolution array.
-			*/
-		}
-		else {
-
-			/*
-				This part is the same as for the other process.
-			*/
-			I = (int**)malloc(sizeof(int*) * (sub_height + 1));
-			if (I) {
-				for (i = 0; i <= sub_height; i++) {
-					I[i] = (int*)malloc(sizeof(int) * height);
-					if (I[i] != NULL) {
-						for (j = 0; j < height; j++) {
-							I[i][j] = 0;
-						}
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				This part is different. The first step here is to receive the sent elements from the
-				previous process. Create a 1D array to store 100 elements and straight away get the
-				Recv function result. These elements will play the part of the first 100 elements of this
-				processes I instance. To conclude the recv_elements has size of 100 integers, receives
-				100 elements from the MPI_Recv function and passes them to the I array.
-			*/
-			int* recv_elements = (int*)malloc(sizeof(int) * height);
-			if (recv_elements) {
-				MPI_Recv(recv_elements, height, MPI_INT, id - 1, 1, MPI_COMM_WORLD, &status);
-				for (j = 0; j < height; j++) {
-					I[0][j] = recv_elements[j];
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				At this point we have 100 elements for the first row of the I array.For it to be ready
-				we get the subarray values all into the I. Careful not to overwrite the first row, the iteration
-				starts at row = 1.At the end of the for loop the I in this case has 5100 elements.
-			*/
-			for (i = 1; i <= sub_height; i++) {
-				for (j = 0; j < height; j++) {
-					I[i][j] = subarray[position];
-					position++;
-				}
-			}
-			position = 0;
-
-			/*
-				While all this preprocessing is occuring, the previous process (id = 0) is waiting to receive
-				the first 100 elements of this process's subarray. Therefore we transfer the elements from the
-				subarray to the recv_elements and to clarify these are the last 100 of the subarray. To finish,
-				we send the recv_elements array back to the other process.
-			*/
-			for (j = 0; j < height; j++) {
-				recv_elements[j] = subarray[position];
-				position++;
-			}
-			MPI_Send(recv_elements, height, MPI_INT, id - 1, 1, MPI_COMM_WORLD);
-			printf("|Finished preparing and sending data for process %d|\n", id);
-
+		if (image_alloc(&I, sub_width, sub_height, 1, 1) != 0 || image_alloc(&A, sub_width, sub_height, 0, 2) != 0) {
+			printf("Malloc allocation failed. Terminating program...\n");
+			MPI_Abort(MPI_COMM_WORLD, 1);
 		}
+		MPI_Type_vector(sub_height, 1, (int)I.pitch, MPI_UNSIGNED_CHAR, &column8);
+		MPI_Type_commit(&column8);
 	}
-	/*
-		As aforementioned for p>2 the in-between processes have to execute more
-		send & receive requests. This does not apply to the first and last processes, because
-		they communicate exclusively with one other process. Therefore the part for these processes
-		are the same with the case of p>2.
-	*/
-
-	else if (p > 2) {
 
-		//Use the tag variable to hold the communication "id" for every send & recv. 
-		pos_counter = 0;
-		position = 0;
-		MPI_Status status;
-		int tag = 1;
-
-		if (id == 0) {
-
-			/*
-				Create the I array with the aditional array.
-				Check malloc allocations.
-				Fill it with zeros.
-			*/
-			I = (int**)malloc(sizeof(int*) * (sub_height + 1));
-			if (I) {
-				for (i = 0;i <= sub_height;i++) {
-					I[i] = (int*)malloc(sizeof(int) * height);
-					if (I[i] != NULL) {
-						I[i][j] = 0;
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				Get the subarray elements into the I but leave the last row.
-				Position set to start at the first elements of the last 100
-				from the subarray. Create the lastelems array ans pass it
-				those values.
-			*/ 
-			for (i = 0; i < sub_height;i++) {
-				for (j = 0;j < height;j++) {
-					I[i][j] = subarray[pos_counter];
-					pos_counter++;
-				}
-			}
-			position = size_to_be_sent - height;
-			pos_counter = 0;
-			int* lastelems = (int*)malloc(sizeof(int) * height);
-			if (lastelems) {
-				for (j = 0;j < height;j++) {
-					lastelems[j] = subarray[position];
-					position++;
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				Sent the elements to the next process. The size is 100. Tag will 1 for all connections.
-				Neutrilize the lastelems array.
-			*/
-			position = 0;
-			MPI_Send(lastelems, height, MPI_INT, id + 1, tag, MPI_COMM_WORLD);
-			for (j = 0;j < height;j++) {
-				lastelems[j] = 0;
-			}
-
-			/*
-				Immediately receive the values from the next process.
-				Pass them to the last row of the I.
-				Then deallocate the lastelems array.
-
-			*/
-			MPI_Recv(lastelems, height, MPI_INT, id + 1, tag, MPI_COMM_WORLD, &status);
-			for (j = 0;j < height;j++) {
-				I[sub_height][j] = lastelems[j];
-			}
-			free(lastelems);
-			printf("|Finished preparing and sending data for process %d|\n", id);
+	//The first and the last row and column of the image are never convoluted, they are zeros in the result.
+	if (row_begin == 0) {
+		memset(image_row16(&A, 0), 0, sizeof(short) * sub_width);
+	}
+	if (row_end == height) {
+		memset(image_row16(&A, sub_height - 1), 0, sizeof(short) * sub_width);
+	}
+	for (i = 0; i < sub_height; i++) {
+		if (col_begin == 0) {
+			image_row16(&A, i)[0] = 0;
 		}
-
-		/*
-				This part is the same as for the 0 process and is the same as is for p = 2.
-		*/
-		if (id == p - 1) {
-
-			/*
-				Create the I array with additional row.
-				Initialize it with zeros.
-				Create recv_elements to get the sent values from previous process.
-				Straight away pass it to the first row of the I array so the elements
-				will act as the first of it.
-			*/
-			I = (int**)malloc(sizeof(int*) * (sub_height + 1));
-			if (I) {
-				for (i = 0;i <= sub_height;i++) {
-					I[i] = (int*)malloc(sizeof(int) * height);
-					if (I[i] != NULL) {
-						for (j = 0; j < height; j++) {
-							I[i][j] = 0;
-						}
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			int* recv_elements = (int*)malloc(sizeof(int) * height);
-			if (recv_elements) {
-				MPI_Recv(recv_elements, height, MPI_INT, id - 1, tag, MPI_COMM_WORLD, &status);
-				for (j = 0;j < height;j++) {
-					I[0][j] = recv_elements[j];
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				Neutrilize the recv_elements array. Again this is not necessary.
-				Get the first 100 elements of the subarray of this process.
-				Send them to the previous process, as they will act as the last elements
-				of it.
-			*/
-			position = 0;
-			for (j = 0;j < height;j++) {
-				recv_elements[j] = 0;
-			}
-
-			for (j = 0;j < height;j++) {
-				recv_elements[j] = subarray[position];
-				position++;
-			}
-			MPI_Send(recv_elements, height, MPI_INT, id - 1, tag, MPI_COMM_WORLD);
-
-			/*
-				Fill the I array after the first row with the values of the subarray.
-				Free the recv_elements array.
-				The I array is ready for the convolution part.
-			*/
-			position = 0;;
-			for (i = 1;i <= sub_height;i++) {
-				for (j = 0;j < height;j++) {
-					I[i][j] = subarray[position];
-					position++;
-				}
-			}
-			free(recv_elements);
-
-			printf("|Finished preparing and sending data for process %d|\n", id);
+		if (col_end == width) {
+			image_row16(&A, i)[sub_width - 1] = 0;
 		}
+	}
 
-		/*
-			This part changes because the middle pack of processes are executed.
-			Right away there are some differences with the other parts.
-			First and foremost the I array tha is created (again seperately for each process)
-			has two additional rows. The reason for this is that, the process must receive the
-			last 100 elements of the previous process and also receive the first 100 elements
-			that belong to the next process. To conclude the I will have 200 elements more than
-			the other processes.
-		*/
-		if (id >= 1 && id != p - 1) {
-			I = (int**)malloc(sizeof(int*) * (sub_height + 2));
-			if (I) {
-				for (i = 0;i < sub_height + 2;i++) {
-					I[i] = (int*)malloc(sizeof(int) * height);
-					if (I[i] != NULL) {
-						for (j = 0;j < height;j++) {
-							I[i][j] = 0;
-						}
-					}else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				We create two arrays. This is for convenience. Both of them have size of 100
-				elements and will be used correspondingly for the previous and the next process.
-			*/
-			int* prev_elements, * next_elements;
-
-			/*
-				The first array, prev_elements, is associated to the previous process.
-				The first step is to recv the elements with size equal to 100.
-				Check malloc allocation of course.
-			*/
-			prev_elements = (int*)malloc(sizeof(int) * height);
-			if (prev_elements) {
-				MPI_Recv(prev_elements, height, MPI_INT, id - 1, tag, MPI_COMM_WORLD, &status);
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				Those received elements will be used as the first row of the I array.
-				Instantly neutrilize the prev_elements with zero, pass to it the first
-				100 elements of the corresponding subarray. Afterwards send them back to
-				the previous process
-			*/
-			for (j = 0;j < height;j++) {
-				I[0][j] = prev_elements[j];
-				prev_elements[j] = 0;
-				prev_elements[j] = subarray[position];
-				position++;
-			}
-			position = 0;
-			MPI_Send(prev_elements, height, MPI_INT, id - 1, tag, MPI_COMM_WORLD);
-
-			/*
-				In the meantime pass the subarray's values to the I array and take care not
-				to meddle with the first row.
-			*/
-			for (i = 1;i < sub_height + 1;i++) {
-				for (j = 0;j < height;j++) {
-					I[i][j] = subarray[position];
-					position++;
-				}
-			}
-
-			/*
-				Now to fix the connections with the next process.
-				Create the next_elements array with size of 100 integers.
-				Because this will be used to send the last elements of this process'
-				last 100 elements on to the next the position variable is set to start
-				in the first of those 100.
-			 */
-			next_elements = (int*)malloc(sizeof(int) * height);
-			position = size_to_be_sent - height;
-
-			/*
-				As said above get the last 100 pieces of the subarray and send them to
-				the next process. Beforhand we have checked for the malloc allocation.
-				The tag component is always the same.
-
-			*/
-			if (next_elements) {
-				for (j = 0;j < height;j++) {
-					next_elements[j] = subarray[position];
-					position++;
-				}
-				MPI_Send(next_elements, height, MPI_INT, id + 1, tag, MPI_COMM_WORLD);
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			/*
-				Straight away recv from the next process its first 100 units.
-				Pass them to the last allowed row capable of the I array.
-				Now the I array is complete and ready for the convolution.
-				The last steps are to deallocate the prev_elements & next_elements
-				to free the memory.
-			*/
-			MPI_Recv(next_elements, height, MPI_INT, id + 1, tag, MPI_COMM_WORLD, &status);
-			for (j = 0;j < height;j++) {
-				I[sub_height + 1][j] = next_elements[j];
-				next_elements[j] = 0;
+	phase_timer_lap(&timer, PHASE_DECOMPOSE);
 
-			}
-			free(prev_elements);
-			free(next_elements);
-			printf("|Finished preparing and sending data for process %d|\n", id);
-		}
+	/*
+		Every process reads its own block of the image with MPI-IO, so the file is read by all the processes at 
+		the same time and nothing has to be scattered by process 0. The stored rows of the block start at 
+		data_offset + stored row * row_stride + col_begin * bytes_per_pixel and are sub_width pixels long. The 
+		file view is a vector of these rows, one row_stride apart, and MPI_File_read_at_all reads them all in one 
+		collective call, which lets MPI merge the requests of the processes into large reads. For a bottom-up 
+		image the last row of the block is stored first, so the rows are turned around while they become gray 
+		values in I.
+	*/
+	MPI_File input;
+	if (MPI_File_open(grid, "image.bmp", MPI_MODE_RDONLY, MPI_INFO_NULL, &input) != MPI_SUCCESS) {
+		printf("Cannot open image.bmp. Check if the file is in the same directory as the program exe.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	int stored_first = top_down ? row_begin : height - row_end;
+	int in_bytes = sub_width * bytes_per_pixel;
+	unsigned char* stored = (unsigned char*)malloc((size_t)sub_height * in_bytes);
+	if (!stored) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_Datatype in_row, in_view;
+	MPI_Type_contiguous(in_bytes, MPI_BYTE, &in_row);
+	MPI_Type_commit(&in_row);
+	MPI_Type_create_hvector(sub_height, 1, (MPI_Aint)row_stride, in_row, &in_view);
+	MPI_Type_commit(&in_view);
+	MPI_File_set_view(input, data_offset + stored_first * row_stride + (MPI_Offset)col_begin * bytes_per_pixel, MPI_BYTE, in_view, "native", MPI_INFO_NULL);
+	if (MPI_File_read_at_all(input, 0, stored, sub_height, in_row, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+		printf("Reading image.bmp failed.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_File_close(&input);
+	phase_timer_lap(&timer, PHASE_LOAD);
+	for (i = 0; i < sub_height; i++) {
+		int row = top_down ? i : sub_height - 1 - i;
+		bmp_gray_span(stored + (size_t)i * in_bytes, sub_width, bytes_per_pixel, image_row8(&I, row));
+	}
+	phase_timer_lap(&timer, PHASE_GRAYSCALE);
+	free(stored);
+	MPI_Type_free(&in_view);
+	MPI_Type_free(&in_row);
+	if (id == 0) {
+		printf("| Succesfully preprocessed the image elements. |\n");
 	}
 
 	/*
-		For the second time in this program the separation happens because of the p value
-		Logically this is the case because the I array in the p>2 occasions is bigger.
+		The shared window is made visible to every process with a fence, after every process has written the 
+		gray values of its block into it.
 	*/
-	if (p == 2) {
-
+	if (shared) {
+		MPI_Win_fence(0, window);
+	}
+	else {
 		/*
-			Create the A array for the convolution. The procedure here is the same as that of the I.
-			It has the same sizes as well.Check malloc allocation. If all is normal then initialize
-			it with zeros.
+			In this part of the code the neighbouring processes exchange the halo they need from each other. 
+			The rows go up and down, the columns left and right, and the corner pixels to the diagonal 
+			neighbours, so the halo is complete without a second round of messages. Every process posts all of 
+			its receives and sends at once with MPI_Irecv and MPI_Isend and does not wait for them. The received 
+			parts go straight into the halo of I and the sent parts are read straight from I. While the halo is 
+			in flight the process convolutes the pixels that do not need it. Only then it waits for the exchange 
+			with MPI_Waitall and convolutes the border of its block. The corners are ordered up-left, up-right, 
+			down-left, down-right, so corner[3 - i] is the one opposite of corner[i].
 		*/
-		A = (int**)malloc(sizeof(int*) * (sub_height + 1));
-		if (A) {
-			for (i = 0; i < sub_height; i++) {
-				A[i] = (int*)malloc(sizeof(int) * height);
-				if (A[i] != NULL) {
-					for (j = 0; j < height; j++) {
-						A[i][j] = 0;
-					}
-				}
-				else {
-					printf("Malloc allocation failed. Terminating program...\n");
-					MPI_Finalize();
-					return 0;
-				}
-			}
-		}
-		else {
-			printf("Malloc allocation failed. Terminating program...\n");
-			MPI_Finalize();
-			return 0;
+		MPI_Irecv(image_row8(&I, -1), sub_width, MPI_UNSIGNED_CHAR, up, tag, grid, &requests[request_count++]);
+		MPI_Irecv(image_row8(&I, sub_height), sub_width, MPI_UNSIGNED_CHAR, down, tag, grid, &requests[request_count++]);
+		MPI_Irecv(image_row8(&I, 0) - 1, 1, column8, left, tag, grid, &requests[request_count++]);
+		MPI_Irecv(image_row8(&I, 0) + sub_width, 1, column8, right, tag, grid, &requests[request_count++]);
+		MPI_Isend(image_row8(&I, 0), sub_width, MPI_UNSIGNED_CHAR, up, tag, grid, &requests[request_count++]);
+		MPI_Isend(image_row8(&I, sub_height - 1), sub_width, MPI_UNSIGNED_CHAR, down, tag, grid, &requests[request_count++]);
+		MPI_Isend(image_row8(&I, 0), 1, column8, left, tag, grid, &requests[request_count++]);
+		MPI_Isend(image_row8(&I, 0) + sub_width - 1, 1, column8, right, tag, grid, &requests[request_count++]);
+		for (i = 0; i < 4; i++) {
+			int row = i < 2 ? -1 : sub_height;
+			int col = i % 2 == 0 ? -1 : sub_width;
+			int own_row = i < 2 ? 0 : sub_height - 1;
+			int own_col = i % 2 == 0 ? 0 : sub_width - 1;
+			MPI_Irecv(image_row8(&I, row) + col, 1, MPI_UNSIGNED_CHAR, corner[i], tag, grid, &requests[request_count++]);
+			MPI_Isend(image_row8(&I, own_row) + own_col, 1, MPI_UNSIGNED_CHAR, corner[i], tag, grid, &requests[request_count++]);
 		}
+	}
+	phase_timer_lap(&timer, PHASE_HALO);
 
-		/*
-			This is were the convolution occurs.The basic equation is changed in the slightest of ways.
-			Because of the added rows in the padding area the dimensions are interchanged from what they
-			should be based on the equation given. But there is an even more important reason for this.
-			The reason is that at max, because of the way scatter works I array and ancillary the A, will
-			be constructed with 51 rows. When the dimension are inversed the y variable will run until it
-			is 100 resulting in segmentation fault. Also that is why x and y start at 1 and end when they
-			are equal to second to last. Ignoring the added rows, but at the same time using them for the
-			convolution of the others.
-		*/
-		for (x = 1; x < sub_height; x++) {
-			for (y = 1; y < height - 1; y++) {
-				for (i = -1; i < 2; i++) {
-					for (j = -1; j < 2; j++) {
-						A[x][y] += h[j + 1][i + 1] * I[x - i][y - j];
-					}
-				}
-				//Check to see if there are any negative numbers produces and turn them into zero. 
-				if (A[x][y] < 0) {
-					A[x][y] = 0;
-				}
-			}
+	/*
+		The pixels to convolute are the rows [first, last) and the columns [first_col, last_col) of the block. 
+		The edges of the image stay zero, so a block at the edge of the image starts one row or column later 
+		or ends one earlier. The inner pixels do not touch the halo. They are convoluted in tiles (tiling.h) 
+		by the kernel in stencil.h, which is specialized at compile time for this mask and turns negative 
+		numbers into zero as it stores them. The border of the block is convoluted after the exchange.
+		In the hybrid mode the inner rows are split between the threads like the rows of the OpenMP program 
+		(partition.h). Only the main thread waits for the halo, the others go on with their rows, and after 
+		a barrier the four sides of the border are shared between the threads.
+		With STENCIL_PERF=1 every thread reads the hardware counters of the processor over its rows 
+		(perf_counters.h), all of them stop counting while the main thread waits for the halo and the others 
+		wait for it at the barrier. The counters of the threads are added up and every process prints the 
+		instructions per cycle, the cache miss rates and the bytes of memory traffic per pixel of its block 
+		next to its time. 
+	*/
+	int perf = perf_counters_requested();
+	long long perf_total[PERF_COUNTERS] = { 0 };
+	tile_plan plan;
+	tiling_plan(&plan, sub_width);
+	int first = (row_begin == 0) ? 1 : 0;
+	int last = (row_end == height) ? sub_height - 1 : sub_height;
+	int first_col = (col_begin == 0) ? 1 : 0;
+	int last_col = (col_end == width) ? sub_width - 1 : sub_width;
+	int inner_first = first > 1 ? first : 1;
+	int inner_last = last < sub_height - 1 ? last : sub_height - 1;
+	int inner_first_col = first_col > 1 ? first_col : 1;
+	int inner_last_col = last_col < sub_width - 1 ? last_col : sub_width - 1;
+	//A block of one row or column at the end of the image has nothing to convolute, the border stays zero.
+	if (inner_first > last) {
+		inner_first = last;
+	}
+	if (inner_first_col > last_col) {
+		inner_first_col = last_col;
+	}
+	if (inner_last < inner_first) {
+		inner_last = inner_first;
+	}
+	if (inner_last_col < inner_first_col) {
+		inner_last_col = inner_first_col;
+	}
+	OMP_PRAGMA(omp parallel)
+	{
+		//Without STENCIL_PERF the counters stay closed, stopping and starting them does nothing.
+		perf_counters counters;
+		counters.leader = -1;
+		if (perf) {
+			perf_counters_open(&counters);
+			perf_counters_reset(&counters);
+			perf_counters_start(&counters);
 		}
-
-		/*
-			Now the gather part is starting.
-			Firstly the subarray will be used to gather the elements from each process.
-			To be certain that there are no mistakes initialize it with zeros while using the
-			2D iteration format.
-		*/
-		position = 0;
-		for (i = 0;i < sub_height;i++) {
-			for (j = 0; j < height; j++) {
-				subarray[position] = 0;
-				position++;
-			}
+		int begin, end;
+		partition_block(inner_last - inner_first, omp_get_num_threads(), omp_get_thread_num(), &begin, &end);
+		stencil_tiled(h, &I, &A, inner_first + begin, inner_first + end, inner_first_col, inner_last_col, &plan);
+		if (perf) {
+			perf_counters_stop(&counters);
 		}
-
-		/*
-			In the case of the first process the number of elements of the A are the first 5000.
-			So the last 100 elements that it received are not included in them. But in the case
-			of the last process inside his 5000 the first 100 are the ones it retreived. So it is
-			very important to not include them into the subarray, because if that was the case we
-			would lose the last 100 elements. Therefore if the last process is executed we pass
-			the first 100 elements and the transfer the data to the subarray.
-
-		*/
-		pos_counter = 0;
-		position = 0;
-		for (i = 0; i < sub_height; i++) {
-			for (j = 0; j < height;j++) {
-				if (id == 1) {
-					pos_counter++;
-					if (pos_counter <= height) {
-						continue;
-					}
-					subarray[position] = A[i][j];
-					position++;
-				}
-				else {
-					subarray[position] = A[i][j];
-					position++;
-
-				}
-			}
+		OMP_PRAGMA(omp master)
+		{
+			phase_timer_lap(&timer, PHASE_CONVOLVE);
+			MPI_Waitall(request_count, requests, MPI_STATUSES_IGNORE);
+			phase_timer_lap(&timer, PHASE_HALO);
+			printf("|Finished preparing and sending data for process %d|\n", id);
 		}
-		printf("|Finished Convolution for process %d|\n", id);
-		/*
-			Convolution finished for p = 2.
-		*/
-
-	}
-	else if (p > 2) {
-		/*
-			Because the I array is bigger for the middle pack of processes here we have an extra separation.
-			The first and last proesses have the exact same execution as for p = 2. So there is no point in
-			analyzing it for the second time.
-		*/
-		if (id == 0 || id == p - 1) {
-			A = (int**)malloc(sizeof(int*) * (sub_height + 1));
-			if (A) {
-				for (i = 0; i < sub_height; i++) {
-					A[i] = (int*)malloc(sizeof(int) * height);
-					if (A[i] != NULL) {
-						for (j = 0; j < height; j++) {
-							A[i][j] = 0;
-						}
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
-			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
-			}
-
-			for (x = 1; x < sub_height; x++) {
-				for (y = 1; y < height - 1; y++) {
-					for (i = -1; i < 2; i++) {
-						for (j = -1; j < 2; j++) {
-							A[x][y] += h[j + 1][i + 1] * I[x - i][y - j];
-						}
-					}
-					if (A[x][y] < 0) {
-						A[x][y] = 0;
-					}
-				}
-			}
-
-			/*
-			Now the gather part is starting.
-			Firstly the subarray will be used to gather the elements from each process.
-			To be certain that there are no mistakes initialize it with zeros while using the
-			2D iteration format.
-			*/
-			position = 0;
-			for (i = 0;i < sub_height;i++) {
-				for (j = 0; j < height; j++) {
-					subarray[position] = 0;
-					position++;
-				}
-			}
-
-			pos_counter = 0;
-			position = 0;
-
-			for (i = 0; i < sub_height; i++) {
-				for (j = 0; j < height;j++) {
-					pos_counter++;
-					if (pos_counter <= height && id == p - 1) {
-						continue;
-					}
-					subarray[position] = A[i][j];
-					position++;
-				}
-			}
-			printf("|Finished Convolution for process %d|\n", id);
-
+		OMP_PRAGMA(omp barrier)
+		if (perf) {
+			perf_counters_start(&counters);
 		}
-		else {
-
-			/*
-				Here is the main difference from p = 2.
-				The A array just like the I gets two additional rows.
-				Check malloc allocation and then initialize it with zeros.
-			*/
-			A = (int**)malloc(sizeof(int*) * (sub_height + 2));
-			if (A) {
-				for (i = 0; i <= sub_height + 1; i++) {
-					A[i] = (int*)malloc(sizeof(int) * height);
-					if (A[i] != NULL) {
-						for (j = 0; j < height; j++) {
-							A[i][j] = 0;
-						}
-					}
-					else {
-						printf("Malloc allocation failed. Terminating program...\n");
-						MPI_Finalize();
-						return 0;
-					}
-				}
+		OMP_PRAGMA(omp for schedule(static, 1))
+		for (int side = 0; side < 4; side++) {
+			if (side == 0) {
+				stencil_tiled(h, &I, &A, first, inner_first, first_col, last_col, &plan);
 			}
-			else {
-				printf("Malloc allocation failed. Terminating program...\n");
-				MPI_Finalize();
-				return 0;
+			else if (side == 1) {
+				stencil_tiled(h, &I, &A, inner_last, last, first_col, last_col, &plan);
 			}
-
-			/*
-				The convolution only changes in the x department where the iteration will be executed
-				for one additional row. The I remember, contains elements given to it for the first row
-				and for the last. So it has to make the convolution happen in all the in between units.
-				That is why this part runs for one more row.
-			*/
-			for (x = 1; x < sub_height + 1; x++) {
-				for (y = 1; y < height - 1; y++) {
-					for (i = -1; i < 2; i++) {
-						for (j = -1; j < 2; j++) {
-							A[x][y] += h[j + 1][i + 1] * I[x - i][y - j];
-						}
-					}
-					//Check for negative values and turn them to zero.
-					if (A[x][y] < 0) {
-						A[x][y] = 0;
-					}
-
-				}
+			else if (side == 2) {
+				stencil_tiled(h, &I, &A, inner_first, inner_last, first_col, inner_first_col, &plan);
 			}
-
-			/*
-			Now the gather part is starting.
-			Firstly the subarray will be used to gather the elements from each process.
-			To be certain that there are no mistakes initialize it with zeros while using the
-			2D iteration format.
-			*/
-			position = 0;
-			for (i = 0;i < sub_height;i++) {
-				for (j = 0; j < height; j++) {
-					subarray[position] = 0;
-					position++;
-				}
-			}
-
-			pos_counter = 0;
-			position = 0;
-			/*
-				For every process skip the first 100 elements and run the iteration for size to sent
-				times. Therefore the subarray will get the exactammount that is convoluted.
-			*/
-			for (i = 0; i < sub_height + 1; i++) {
-				for (j = 0; j < height;j++) {
-					pos_counter++;
-					if (pos_counter <= height) {
-						continue;
-					}
-					subarray[position] = A[i][j];
-					position++;
-
-				}
+			else {
+				stencil_tiled(h, &I, &A, inner_first, inner_last, inner_last_col, last_col, &plan);
 			}
-			printf("|Finished Convolution for process %d|\n", id);
+		}
+		if (perf) {
+			long long values[PERF_COUNTERS];
+			perf_counters_stop(&counters);
+			perf_counters_read(&counters, values);
+			perf_counters_close(&counters);
+			OMP_PRAGMA(omp critical)
+			perf_counters_add(perf_total, values);
 		}
 	}
+	phase_timer_lap(&timer, PHASE_CONVOLVE);
+	printf("|Finished Convolution for process %d|\n", id);
 
 	/*
 		The Convolution ends for all cases. Now the writing to a file remains
@@ -1008,91 +507,92 @@ int main(int argc, char** argv) {
 	*/
 	wtime = MPI_Wtime() - wtime;
 	printf("|Time of execution for process %d ==> %f|\n\n", id, wtime);
+	if (perf) {
+		perf_counters_print("process", id, perf_total, (long long)(last - first) * (last_col - first_col));
+	}
 
 	/*
-		But firstly we need to gather the data from each process.
-		Create a 1D array with the size of the picture.
-		Check malloc allocation.
+		Now to save them. Every process writes its own block to the second file with MPI-IO, so nothing is 
+		gathered on process 0. The file is created by all the processes together and its size is set to the 
+		header and height padded rows, which also cuts off an older and longer file of the same name. Process 0 
+		writes the header. Do no forget that the file is a bmp image, so for each position, three values are 
+		needed: every process copies each value of its block three times into rows of 3 * sub_width bytes, 
+		in the order they are stored in the file. The blocks in the last column of the grid also carry the 
+		zero padding of their rows. The file view places these rows one stored row apart after the header and 
+		MPI_File_write_at_all writes all the blocks in one collective call.
 	*/
+	MPI_File output;
+	if (MPI_File_open(grid, "image_alter.bmp", MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &output) != MPI_SUCCESS) {
+		printf("The file image_alter.bmp could not be openned or created.\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_Offset out_stride = (MPI_Offset)bmp_row_stride(width, 3);
+	MPI_File_set_size(output, BMP_HEADER_SIZE + out_stride * height);
+	int failed = 0;
 	if (id == 0) {
-		gather = (int*)malloc(sizeof(int) * size_to_be_sent * p);
-		if (!gather) {
-			printf("Malloc allocation failed. Terminating program...\n");
-			MPI_Finalize();
-			return 0;
-		}
+		failed = MPI_File_write_at(output, 0, header, BMP_HEADER_SIZE, MPI_BYTE, MPI_STATUS_IGNORE) != MPI_SUCCESS;
 	}
+	int out_bytes = 3 * sub_width + (col_end == width ? (int)(out_stride - 3 * (MPI_Offset)width) : 0);
+	unsigned char* encoded = (unsigned char*)calloc((size_t)sub_height, out_bytes);
+	if (!encoded) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	for (i = 0; i < sub_height; i++) {
+		int row = top_down ? i : sub_height - 1 - i;
+		bmp_encode_row16(image_row16(&A, row), sub_width, encoded + (size_t)i * out_bytes);
+	}
+	MPI_Datatype out_row, out_view;
+	MPI_Type_contiguous(out_bytes, MPI_BYTE, &out_row);
+	MPI_Type_commit(&out_row);
+	MPI_Type_create_hvector(sub_height, 1, (MPI_Aint)out_stride, out_row, &out_view);
+	MPI_Type_commit(&out_view);
+	MPI_File_set_view(output, BMP_HEADER_SIZE + stored_first * out_stride + 3 * (MPI_Offset)col_begin, MPI_BYTE, out_view, "native", MPI_INFO_NULL);
+	if (MPI_File_write_at_all(output, 0, encoded, sub_height, out_row, MPI_STATUS_IGNORE) != MPI_SUCCESS) {
+		failed = 1;
+	}
+	if (failed) {
+		printf("Writing the result file failed.\n");
+	}
+
+	//Close the connection to the file and deallocate the encoded rows.
+	MPI_File_close(&output);
+	free(encoded);
+	MPI_Type_free(&out_view);
+	MPI_Type_free(&out_row);
+	phase_timer_lap(&timer, PHASE_WRITE);
 
 	/*
-		This is where it all come down to. MPI_Gather collects every part - subarray and unites them
-		into the gather array.
+		The times of the phases of all the processes are reduced to their minimum, maximum and sum on 
+		process 0, which prints them as one line of JSON.
 	*/
-	MPI_Gather(subarray, size_to_be_sent, MPI_INT, gather, size_to_be_sent, MPI_INT, master, MPI_COMM_WORLD);
-
+	phase_timer_stop(&timer);
+	phase_stats stats;
+	phase_stats_from_timer(&stats, &timer);
+	MPI_Reduce(timer.seconds, stats.min, PHASE_COUNT, MPI_DOUBLE, MPI_MIN, master, MPI_COMM_WORLD);
+	MPI_Reduce(timer.seconds, stats.max, PHASE_COUNT, MPI_DOUBLE, MPI_MAX, master, MPI_COMM_WORLD);
+	MPI_Reduce(timer.seconds, stats.mean, PHASE_COUNT, MPI_DOUBLE, MPI_SUM, master, MPI_COMM_WORLD);
 	if (id == 0) {
-		/*
-			Now to save them.
-			Open the new file connection to the second file.
-			Check to see if it openned succesfully.
-			If the file does not exist it will be created.
-		*/
-
-		fpout = fopen("image_alter.bmp", "wb");
-		if (fpout == NULL) {
-			printf("The file cound not be openned or created.\n");
-			MPI_Finalize();
-			return 0;
-		}
-
-		/*
-			Write the characteristics of the other file to the new one.
-			The last separation of choices is here.
-			If p > 4 then skip the added rows that originally happened during padding.
-			Be careful to store to the file only the ammount of elements it can withhold.
-			Do no forget that the file is a bmp image, so for each position, three values
-			are needed. Using putc to insert one unit at a time.
-
-		*/
-		fwrite(header, sizeof(unsigned char), 54, fpout);
-		position = 0;
-		if (p == 8 || p == 16) {
-			for (i = 0;i < height + (p - 4);i++) {
-				for (j = 0; j < width; j++) {
-					if (position >= (height * ((p - 4) / 2)) && position < ((height * ((p - 4) / 2)) + (height * width))) {
-						putc(gather[position], fpout);
-						putc(gather[position], fpout);
-						putc(gather[position], fpout);
-
-					}
-					position++;
-				}
-			}
-			/*
-				If p <= 4, then input the elements normaly just like the previous question.
-			*/
-		}
-		else {
-			for (i = 0;i < height;i++) {
-				for (j = 0; j < width; j++) {
-					putc(gather[position], fpout);
-					putc(gather[position], fpout);
-					putc(gather[position], fpout);
-					position++;
-				}
-			}
+		for (i = 0; i < PHASE_COUNT; i++) {
+			stats.mean[i] /= p;
 		}
-		/*
-			Close the connection to the file
-			and deallocate all of the gather array and the columns of A an I
-		*/
-		fclose(fpout);
-		free(gather);
-		free(A);
-		free(I);
+		phase_stats_json(&stats, "mpi", width, height, p, threads);
 		printf("|*** Program finished.To see the result open the file used to write the convoluted data. ***|\n");
+	}
 
+	//Every process deallocates its own parts of the image.
+	//With the shared window I and A are only views, the window is freed by all the processes together.
+	if (shared) {
+		MPI_Win_free(&window);
+	}
+	else {
+		MPI_Type_free(&column8);
+		image_free(&A);
+		image_free(&I);
 	}
+	MPI_Comm_free(&node);
+	MPI_Comm_free(&grid);
 	MPI_Finalize();
 	return 0;
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,167 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+/*
+	Pinning of threads to cores.
+	A thread that the scheduler moves to another core leaves its caches behind, and on a machine
+	with several sockets it can end up far away from the memory it works on. The launcher (mpirun
+	--bind-to, taskset, numactl) decides which cores a process may use. Here these cores are listed
+	and every thread of the process is pinned to one of them, so the threads of a process stay on
+	its cores and do not move between them. On systems without sched_setaffinity nothing is pinned.
+	The cores are listed NUMA node by NUMA node, and the node of a thread and the nodes that hold
+	the pages of a buffer can be looked up, so that a program can report where its threads and its
+	memory ended up.
+*/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+//Largest count of cores that is listed.
+#define AFFINITY_MAX_CPUS 1024
+//Largest count of NUMA nodes that is told apart.
+#define AFFINITY_MAX_NODES 64
+
+//NUMA node of a core from sysfs, 0 if it is not known.
+static inline int affinity_cpu_node(int cpu) {
+	int node = 0;
+#ifdef __linux__
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		return 0;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+#else
+	(void)cpu;
+#endif
+	return node < AFFINITY_MAX_NODES ? node : 0;
+}
+
+/*
+	The cores the calling thread may run on, the cores of NUMA node 0 first, then those of node 1
+	and so on, in increasing order inside a node. Returns their count or 0 if it is not known.
+*/
+static inline int affinity_cpus(int* cpus, int max) {
+	int count = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return 0;
+	}
+	int nodes[AFFINITY_MAX_CPUS];
+	for (int cpu = 0; cpu < CPU_SETSIZE && count < max && count < AFFINITY_MAX_CPUS; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			//Insert after the cores of the same or a lower node.
+			int node = affinity_cpu_node(cpu);
+			int at = count;
+			while (at > 0 && nodes[at - 1] > node) {
+				cpus[at] = cpus[at - 1];
+				nodes[at] = nodes[at - 1];
+				at--;
+			}
+			cpus[at] = cpu;
+			nodes[at] = node;
+			count++;
+		}
+	}
+#else
+	(void)cpus;
+	(void)max;
+#endif
+	return count;
+}
+
+//Pin the calling thread to one core. Returns 0 on success and -1 if it could not be pinned.
+static inline int affinity_pin(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#else
+	(void)cpu;
+	return -1;
+#endif
+}
+
+/*
+	Core of thread out of threads when they are spread evenly over count cores listed by
+	affinity_cpus: consecutive threads stay together on a node and every node gets its share of
+	the threads, so all the memory controllers are used even when there are fewer threads than cores.
+*/
+static inline int affinity_spread(const int* cpus, int count, int thread, int threads) {
+	if (threads <= count) {
+		return cpus[(long)thread * count / threads];
+	}
+	return cpus[thread % count];
+}
+
+//NUMA node the calling thread runs on, -1 if it is not known.
+static inline int affinity_current_node(void) {
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned int cpu = 0, node = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+		return (int)node;
+	}
+#endif
+	return -1;
+}
+
+/*
+	Count the pages of [data, data + size) on every NUMA node into pages[0 .. AFFINITY_MAX_NODES - 1].
+	Pages that were never written have no node and are not counted. move_pages only reports the
+	node of every page when it is not given target nodes. Returns 0 or -1 if it is not supported.
+*/
+static inline int affinity_page_nodes(const void* data, size_t size, long* pages) {
+#if defined(__linux__) && defined(SYS_move_pages)
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t first = (size_t)data / page_size * page_size;
+	size_t last = (size_t)data + size;
+	void* batch[256];
+	int status[256];
+	while (first < last) {
+		unsigned long n = 0;
+		for (; n < 256 && first < last; n++, first += page_size) {
+			batch[n] = (void*)first;
+		}
+		if (syscall(SYS_move_pages, 0, n, batch, NULL, status, 0) != 0) {
+			return -1;
+		}
+		for (unsigned long k = 0; k < n; k++) {
+			if (status[k] >= 0 && status[k] < AFFINITY_MAX_NODES) {
+				pages[status[k]]++;
+			}
+		}
+	}
+	return 0;
+#else
+	(void)data;
+	(void)size;
+	(void)pages;
+	return -1;
+#endif
+}
+
+#endif
@@ -0,0 +1,68 @@
+#
+# Functions shared by the benchmark scripts, sourced by them. They expect ROOT (top of the
+# repository), WORKDIR (directory for the binaries and images), PROGRAMS and MPIRUN to be set.
+#
+
+# Build the image generator and the programs named in PROGRAMS into WORKDIR.
+bench_build() {
+	echo "Building the programs in $WORKDIR"
+	gcc -O2 -o "$WORKDIR/make_bmp" "$ROOT/bench/make_bmp.c"
+	case " $PROGRAMS " in *" serial "*) g++ -O2 -o "$WORKDIR/serial" "$ROOT/Full_First_with_comments.cpp" ;; esac
+	case " $PROGRAMS " in *" openmp "*) gcc -O2 -fopenmp -o "$WORKDIR/openmp" "$ROOT/Full_OpenMP_with_comments.c" ;; esac
+	case " $PROGRAMS " in *" mpi "*) mpicxx -O2 -o "$WORKDIR/mpi" "$ROOT/Full_MPI_with_comments.cpp" ;; esac
+}
+
+# bench_image width height: path of a synthetic image of that size, it is made the first time.
+bench_image() {
+	dir="$WORKDIR/$1x$2"
+	mkdir -p "$dir"
+	if [ ! -f "$dir/image.bmp" ]; then
+		"$WORKDIR/make_bmp" "$1" "$2" "$dir/image.bmp" > /dev/null
+	fi
+	echo "$dir"
+}
+
+# bench_phase file phase: seconds of a phase of a timings file, the maximum over the processes, 0 if it is not there.
+bench_phase() {
+	value=$(sed -n "s/.*\"$2\":{\"min\":[0-9.e+-]*,\"mean\":[0-9.e+-]*,\"max\":\([0-9.e+-]*\)}.*/\1/p" "$1")
+	echo "${value:-0}"
+}
+
+# Median of the numbers on standard input.
+bench_median() {
+	sort -g | awk '{ v[NR] = $1 } END { if (NR == 0) print ""; else if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# bench_run program workers directory: one run on the image.bmp of the directory. Prints the total
+# seconds and the seconds of the load and write phases, or nothing if the run failed.
+bench_run() {
+	(
+		cd "$3"
+		rm -f timings.json image_alter.bmp
+		case $1 in
+			serial) STENCIL_TIMINGS=timings.json "$WORKDIR/serial" > run.log 2>&1 || exit 0 ;;
+			openmp) STENCIL_TIMINGS=timings.json "$WORKDIR/openmp" "$2" > run.log 2>&1 || exit 0 ;;
+			mpi) STENCIL_TIMINGS=timings.json $MPIRUN "$2" "$WORKDIR/mpi" > run.log 2>&1 || exit 0 ;;
+		esac
+		if [ -f timings.json ] && [ -f image_alter.bmp ]; then
+			echo "$(bench_phase timings.json total) $(bench_phase timings.json load) $(bench_phase timings.json write)"
+		fi
+	)
+}
+
+# bench_measure program workers directory: WARMUP untimed runs and REPEATS timed runs. Prints the
+# count of timed runs that worked and the medians of their total, load and write seconds.
+bench_measure() {
+	i=0
+	while [ $i -lt "$WARMUP" ]; do
+		bench_run "$1" "$2" "$3" > /dev/null
+		i=$((i + 1))
+	done
+	: > "$3/times.txt"
+	i=0
+	while [ $i -lt "$REPEATS" ]; do
+		bench_run "$1" "$2" "$3" >> "$3/times.txt"
+		i=$((i + 1))
+	done
+	echo "$(wc -l < "$3/times.txt" | tr -d ' ') $(cut -d' ' -f1 "$3/times.txt" | bench_median) $(cut -d' ' -f2 "$3/times.txt" | bench_median) $(cut -d' ' -f3 "$3/times.txt" | bench_median)"
+}
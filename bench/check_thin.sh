@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Check of the MPI program on thin images.
+# The grid of the MPI program can give a block of a single row or column at the edge of the image,
+# whose pixels all belong to the zero border. Images of a few rows or columns are made with
+# bench/make_bmp.c, the serial program converts them once and the MPI program converts them with
+# every process count. Its result has to be the same file, byte for byte.
+#
+# Run from the top of the repository:  sh bench/check_thin.sh
+# Settings (environment):
+#   SHAPES   sizes of the images, width x height   default "3x3 130x3 3x130 1000x4 4x1000 5x7"
+#   WORKERS  processes of MPI                      default "2 3 4 6"
+#   MPIRUN   command that starts the MPI program   default "mpirun -np"
+#   WORKDIR  directory for the binaries and images default bench_work
+
+set -e
+
+SHAPES=${SHAPES:-"3x3 130x3 3x130 1000x4 4x1000 5x7"}
+WORKERS=${WORKERS:-"2 3 4 6"}
+WARMUP=0
+REPEATS=1
+MPIRUN=${MPIRUN:-"mpirun -np"}
+WORKDIR=${WORKDIR:-bench_work}
+PROGRAMS="serial mpi"
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+
+. "$ROOT/bench/bench_lib.sh"
+bench_build
+
+failed=0
+for shape in $SHAPES; do
+	dir=$(bench_image "${shape%x*}" "${shape#*x}")
+	bench_run serial 1 "$dir" > /dev/null
+	if [ ! -f "$dir/image_alter.bmp" ]; then
+		echo "serial $shape failed, see $dir/run.log"
+		failed=1
+		continue
+	fi
+	mv "$dir/image_alter.bmp" "$dir/serial.bmp"
+	for workers in $WORKERS; do
+		bench_run mpi "$workers" "$dir" > /dev/null
+		if [ -f "$dir/image_alter.bmp" ] && cmp -s "$dir/serial.bmp" "$dir/image_alter.bmp"; then
+			echo "mpi $shape with $workers processes: same as the serial program"
+		else
+			echo "mpi $shape with $workers processes: differs from the serial program, see $dir/run.log"
+			failed=1
+		fi
+	done
+done
+exit $failed
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../image_buffer.h"
+#include "../stencil.h"
+#include "../tiling.h"
+#include "../perf_counters.h"
+
+#ifdef STENCIL_X86
+#include <x86intrin.h>
+#endif
+
+/*
+	Micro-benchmark of the convolution kernels, in the manner of Google Benchmark.
+	Only the 3x3 convolution and the clamp of a gray image are timed. The file, the grayscale
+	conversion and the threads are left out, so a change of a kernel is measured on its own and not
+	through the noise of a whole run. The kernels:
+		int**     the loops of the original programs: rows of int allocated one by one, the nine taps
+		          through the mask array, the sums added into A (set to zero first) and clamped in a
+		          second pass over A
+		flat      the generic kernel of stencil.h on the flat buffers of image_buffer.h
+		unrolled  the scalar Laplacian kernel of stencil.h, the taps fixed at compile time
+		sse41, avx2, avx512  the vector Laplacian kernels of stencil.h, those the CPU supports
+	Every kernel runs on square images of the given edges, from images that stay in the L1 cache up
+	to images that only fit in memory, the column "fits" tells which. Like in Google Benchmark the
+	iterations of a kernel are increased until they take at least the minimum time, and the time of
+	one iteration is printed with the pixels per cycle and the effective bandwidth: the bytes of the
+	input read once and of the output written once for every pixel, divided by the time. The cycles
+	come from the hardware counters (perf_counters.h), or from the time stamp counter, which ticks at
+	the nominal frequency of the CPU, when they are not available. The result of every kernel is
+	checked against the unrolled kernel.
+
+	Compile: gcc -O2 -o kernel_bench bench/kernel_bench.c
+	Run:     ./kernel_bench [--filter=name] [--min_time=seconds] [edge ...]
+*/
+
+//Edges of the images when none are given.
+static const int bench_default_edges[] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+
+typedef struct bench_data {
+	int edge;
+	int h[3][3];
+	image_buffer I;		//Gray values of the flat kernels.
+	image_buffer A;		//Results of the flat kernels.
+	int** rows_in;		//The same gray values as rows of int, for the int** kernel.
+	int** rows_out;
+} bench_data;
+
+typedef void (*bench_kernel_fn)(bench_data* d, stencil_row_fn row);
+
+typedef struct bench_variant {
+	const char* name;
+	bench_kernel_fn run;
+	stencil_row_fn row;		//Row kernel of bench_rows, NULL for the others.
+	int bytes_per_pixel;	//A pixel of the input and of the output.
+} bench_variant;
+
+//The nest of the original programs.
+static void bench_int_rows(bench_data* d, stencil_row_fn row) {
+	int n = d->edge;
+	(void)row;
+	for (int x = 0; x < n; x++) {
+		memset(d->rows_out[x], 0, n * sizeof(int));
+	}
+	for (int x = 1; x < n - 1; x++) {
+		for (int y = 1; y < n - 1; y++) {
+			for (int i = -1; i < 2; i++) {
+				for (int j = -1; j < 2; j++) {
+					d->rows_out[x][y] += d->h[j + 1][i + 1] * d->rows_in[x - j][y - i];
+				}
+			}
+		}
+	}
+	for (int x = 0; x < n; x++) {
+		for (int y = 0; y < n; y++) {
+			if (d->rows_out[x][y] < 0) {
+				d->rows_out[x][y] = 0;
+			}
+		}
+	}
+}
+
+static void bench_flat(bench_data* d, stencil_row_fn row) {
+	(void)row;
+	for (int x = 1; x < d->edge - 1; x++) {
+		stencil_generic_row(d->h, image_row8(&d->I, x - 1), image_row8(&d->I, x), image_row8(&d->I, x + 1), image_row16(&d->A, x), 1, d->edge - 1);
+	}
+}
+
+static void bench_rows(bench_data* d, stencil_row_fn row) {
+	for (int x = 1; x < d->edge - 1; x++) {
+		row(image_row8(&d->I, x - 1), image_row8(&d->I, x), image_row8(&d->I, x + 1), image_row16(&d->A, x), 1, d->edge - 1);
+	}
+}
+
+//1 if the CPU can run the kernel.
+static int bench_supported(const char* name) {
+#ifdef STENCIL_X86
+	if (strcmp(name, "sse41") == 0) {
+		return __builtin_cpu_supports("sse4.1");
+	}
+	if (strcmp(name, "avx2") == 0) {
+		return __builtin_cpu_supports("avx2");
+	}
+	if (strcmp(name, "avx512") == 0) {
+		return __builtin_cpu_supports("avx512bw");
+	}
+#endif
+	(void)name;
+	return 1;
+}
+
+static double bench_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+//Time stamp counter, -1 where there is none.
+static long long bench_ticks(void) {
+#ifdef STENCIL_X86
+	return (long long)__rdtsc();
+#else
+	return -1;
+#endif
+}
+
+static void bench_free(bench_data* d) {
+	for (int x = 0; x < d->edge; x++) {
+		free(d->rows_in != NULL ? d->rows_in[x] : NULL);
+		free(d->rows_out != NULL ? d->rows_out[x] : NULL);
+	}
+	free(d->rows_in);
+	free(d->rows_out);
+	image_free(&d->A);
+	image_free(&d->I);
+}
+
+//The random gray image of an edge in both layouts. Returns 0 or -1 if the memory ran out.
+static int bench_alloc(bench_data* d, int edge) {
+	int h[3][3] = { {0,1,0},{1,-4,1},{0,1,0} };
+	memcpy(d->h, h, sizeof(h));
+	d->edge = edge;
+	d->rows_in = (int**)calloc(edge, sizeof(int*));
+	d->rows_out = (int**)calloc(edge, sizeof(int*));
+	int failed = image_alloc(&d->I, edge, edge, 0, 1) != 0;
+	failed = image_alloc(&d->A, edge, edge, 0, 2) != 0 || failed;
+	if (d->rows_in == NULL || d->rows_out == NULL || failed) {
+		return -1;
+	}
+	srand(1);
+	for (int x = 0; x < edge; x++) {
+		d->rows_in[x] = (int*)malloc(edge * sizeof(int));
+		d->rows_out[x] = (int*)calloc(edge, sizeof(int));
+		if (d->rows_in[x] == NULL || d->rows_out[x] == NULL) {
+			return -1;
+		}
+		unsigned char* row = image_row8(&d->I, x);
+		for (int y = 0; y < edge; y++) {
+			row[y] = (unsigned char)(rand() & 0xFF);
+			d->rows_in[x][y] = row[y];
+		}
+	}
+	return 0;
+}
+
+//1 if the last result of the variant equals the reference.
+static int bench_check(const bench_data* d, const bench_variant* v, const image_buffer* reference) {
+	for (int x = 1; x < d->edge - 1; x++) {
+		const short* expected = image_row16(reference, x);
+		for (int y = 1; y < d->edge - 1; y++) {
+			int value = v->run == bench_int_rows ? d->rows_out[x][y] : image_row16(&d->A, x)[y];
+			if (value != expected[y]) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+//Level of the cache that holds bytes, or "memory".
+static const char* bench_fits(long bytes, long l1, long l2, long l3) {
+	return bytes <= l1 ? "L1" : bytes <= l2 ? "L2" : bytes <= l3 ? "L3" : "memory";
+}
+
+int main(int argc, char** argv) {
+	const char* filter = NULL;
+	double min_time = 0.2;
+	int edges[64];
+	int edge_count = 0;
+	bench_variant variants[] = {
+		{ "int**", bench_int_rows, NULL, 2 * (int)sizeof(int) },
+		{ "flat", bench_flat, NULL, 3 },
+		{ "unrolled", bench_rows, stencil_laplacian_row, 3 },
+#ifdef STENCIL_X86
+		{ "sse41", bench_rows, stencil_laplacian_row_sse41, 3 },
+		{ "avx2", bench_rows, stencil_laplacian_row_avx2, 3 },
+		{ "avx512", bench_rows, stencil_laplacian_row_avx512, 3 },
+#endif
+	};
+	int variant_count = (int)(sizeof(variants) / sizeof(variants[0]));
+
+	for (int a = 1; a < argc; a++) {
+		if (strncmp(argv[a], "--filter=", 9) == 0) {
+			filter = argv[a] + 9;
+		}else if (strncmp(argv[a], "--min_time=", 11) == 0) {
+			min_time = atof(argv[a] + 11);
+		}else if (atoi(argv[a]) >= 3 && edge_count < 64) {
+			edges[edge_count++] = atoi(argv[a]);
+		}else {
+			printf("Usage: %s [--filter=name] [--min_time=seconds] [edge >= 3 ...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (edge_count == 0) {
+		edge_count = (int)(sizeof(bench_default_edges) / sizeof(bench_default_edges[0]));
+		memcpy(edges, bench_default_edges, sizeof(bench_default_edges));
+	}
+
+	long l1 = tiling_cache_size(1);
+	long l2 = tiling_cache_size(2);
+	long l3 = 0;
+#ifdef __linux__
+	l3 = tiling_sysfs_cache_size(3);
+#endif
+	if (l3 < l2) {
+		l3 = l2;
+	}
+	perf_counters counters;
+	int have_counters = perf_counters_open(&counters) == 0;
+	printf("Kernel of the programs %s, L1 %ld KB, L2 %ld KB, L3 %ld KB, cycles from %s, minimum time %.2f s\n",
+		stencil_kernel_name(), l1 / 1024, l2 / 1024, l3 / 1024, have_counters ? "the hardware counters" : "the time stamp counter", min_time);
+	printf("%-20s %14s %12s %8s %14s %10s\n", "Benchmark", "Time (ns)", "Iterations", "Fits", "Pixels/cycle", "GB/s");
+
+	for (int e = 0; e < edge_count; e++) {
+		bench_data d;
+		image_buffer reference;
+		memset(&d, 0, sizeof(d));
+		if (bench_alloc(&d, edges[e]) != 0 || image_alloc(&reference, edges[e], edges[e], 0, 2) != 0) {
+			printf("Malloc allocation failed. Terminating program...\n");
+			return 1;
+		}
+		for (int x = 1; x < d.edge - 1; x++) {
+			stencil_laplacian_row(image_row8(&d.I, x - 1), image_row8(&d.I, x), image_row8(&d.I, x + 1), image_row16(&reference, x), 1, d.edge - 1);
+		}
+		long long pixels = (long long)(d.edge - 2) * (d.edge - 2);
+
+		for (int v = 0; v < variant_count; v++) {
+			char name[64];
+			snprintf(name, sizeof(name), "%s/%d", variants[v].name, d.edge);
+			if ((filter != NULL && strstr(name, filter) == NULL) || !bench_supported(variants[v].name)) {
+				continue;
+			}
+
+			//One untimed iteration warms the caches, then the iterations grow until they take min_time.
+			variants[v].run(&d, variants[v].row);
+			long long iterations = 1;
+			double elapsed = 0.0;
+			long long cycles = -1;
+			for (;;) {
+				long long values[PERF_COUNTERS];
+				perf_counters_reset(&counters);
+				perf_counters_start(&counters);
+				long long ticks = bench_ticks();
+				double start = bench_seconds();
+				for (long long it = 0; it < iterations; it++) {
+					variants[v].run(&d, variants[v].row);
+				}
+				elapsed = bench_seconds() - start;
+				ticks = bench_ticks() - ticks;
+				perf_counters_stop(&counters);
+				perf_counters_read(&counters, values);
+				cycles = values[PERF_CYCLES] > 0 ? values[PERF_CYCLES] : bench_ticks() >= 0 ? ticks : -1;
+				if (elapsed >= min_time || iterations >= (1LL << 40)) {
+					break;
+				}
+				//Aim a little beyond min_time, but never grow by more than ten times at once.
+				double factor = elapsed > 0.0 ? 1.4 * min_time / elapsed : 10.0;
+				factor = factor < 2.0 ? 2.0 : factor > 10.0 ? 10.0 : factor;
+				iterations = (long long)(iterations * factor);
+			}
+
+			double per_iteration = elapsed / iterations;
+			long bytes = (long)(pixels * variants[v].bytes_per_pixel);
+			char per_cycle[32] = "n/a";
+			if (cycles > 0) {
+				snprintf(per_cycle, sizeof(per_cycle), "%.3f", (double)pixels * iterations / cycles);
+			}
+			printf("%-20s %14.0f %12lld %8s %14s %10.2f%s\n", name, per_iteration * 1e9, iterations, bench_fits(bytes, l1, l2, l3),
+				per_cycle, bytes / per_iteration / 1e9, bench_check(&d, &variants[v], &reference) ? "" : "  WRONG RESULT");
+		}
+
+		image_free(&reference);
+		bench_free(&d);
+	}
+
+	perf_counters_close(&counters);
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../bmp_io.h"
+
+/*
+	Generator of synthetic test images for the benchmarks.
+	Writes an uncompressed 24-bit bmp of the given size. The pixels come from a fixed pseudo-random
+	sequence mixed with a pattern of rings and stripes, so the image has edges for the Laplacian to
+	find and the same arguments always give the same file. A negative height writes a top-down image.
+
+	Compile: gcc -O2 -o make_bmp bench/make_bmp.c
+	Run:     ./make_bmp width height file.bmp
+*/
+
+int main(int argc, char** argv) {
+	if (argc < 4 || atoi(argv[1]) <= 0 || atoi(argv[2]) == 0) {
+		printf("Usage: %s width height file.bmp (a negative height writes a top-down image)\n", argv[0]);
+		return 1;
+	}
+	int width = atoi(argv[1]);
+	int signed_height = atoi(argv[2]);
+	int height = signed_height < 0 ? -signed_height : signed_height;
+	size_t stride = bmp_row_stride(width, 3);
+
+	unsigned char header[BMP_HEADER_SIZE] = { 'B', 'M' };
+	bmp_write_le32(&header[2], (int)(BMP_HEADER_SIZE + stride * height));
+	bmp_write_le32(&header[10], BMP_HEADER_SIZE);
+	bmp_write_le32(&header[14], 40);
+	bmp_write_le32(&header[18], width);
+	bmp_write_le32(&header[22], signed_height);
+	header[26] = 1;
+	header[28] = 24;
+	bmp_write_le32(&header[34], (int)(stride * height));
+	bmp_write_le32(&header[38], 2835);
+	bmp_write_le32(&header[42], 2835);
+
+	FILE* file = fopen(argv[3], "wb");
+	unsigned char* row = (unsigned char*)calloc(stride, 1);
+	if (file == NULL || row == NULL) {
+		printf("The file %s could not be openned or created.\n", argv[3]);
+		return 1;
+	}
+	fwrite(header, 1, BMP_HEADER_SIZE, file);
+
+	unsigned int seed = 12345u;
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			seed = seed * 1103515245u + 12345u;
+			int dx = x - width / 2;
+			int dy = y - height / 2;
+			int ring = (int)(((long long)dx * dx + (long long)dy * dy) >> 6) & 0x3F;
+			int stripe = ((x / 16) + (y / 16)) & 1 ? 0x40 : 0;
+			int noise = (int)(seed >> 24) & 0x1F;
+			row[3 * x] = (unsigned char)(ring * 2 + noise);
+			row[3 * x + 1] = (unsigned char)(stripe + noise * 2);
+			row[3 * x + 2] = (unsigned char)(ring + stripe + noise);
+		}
+		if (fwrite(row, 1, stride, file) != stride) {
+			printf("Writing to %s failed.\n", argv[3]);
+			fclose(file);
+			free(row);
+			return 1;
+		}
+	}
+
+	free(row);
+	return fclose(file) == 0 ? 0 : 1;
+}
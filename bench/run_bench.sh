@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Benchmark suite of the three convolution programs.
+# Synthetic images from 256x256 up to 16384x16384 are made with bench/make_bmp.c, every program
+# converts every image with every worker count, WARMUP times untimed and REPEATS times timed.
+# The time of a run is the total phase of the JSON timings the programs print (phase_timer.h),
+# for MPI the maximum over the processes, so the start of the processes is not counted. The
+# median of the timed runs and the throughput in megapixels per second go to a CSV file, one line
+# for every program, image and worker count, so the results of two commits can be compared.
+#
+# Run from the top of the repository:  sh bench/run_bench.sh [results.csv]
+# Settings (environment):
+#   SIZES    edges of the square images              default "256 512 1024 2048 4096 8192 16384"
+#   WORKERS  threads of OpenMP and processes of MPI  default "1 2 4 8"
+#   WARMUP   untimed runs before the timed ones      default 1
+#   REPEATS  timed runs                              default 5
+#   MPIRUN   command that starts the MPI program     default "mpirun -np"
+#   WORKDIR  directory for the binaries and images   default bench_work
+#   PROGRAMS which programs run                      default "serial openmp mpi"
+
+set -e
+
+OUT=${1:-bench_results.csv}
+SIZES=${SIZES:-"256 512 1024 2048 4096 8192 16384"}
+WORKERS=${WORKERS:-"1 2 4 8"}
+WARMUP=${WARMUP:-1}
+REPEATS=${REPEATS:-5}
+MPIRUN=${MPIRUN:-"mpirun -np"}
+WORKDIR=${WORKDIR:-bench_work}
+PROGRAMS=${PROGRAMS:-"serial openmp mpi"}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+OUT=$(cd "$(dirname "$OUT")" && pwd)/$(basename "$OUT")
+
+. "$ROOT/bench/bench_lib.sh"
+bench_build
+
+echo "program,width,height,workers,runs,median_seconds,megapixels_per_second" > "$OUT"
+for size in $SIZES; do
+	dir=$(bench_image "$size" "$size")
+	for program in $PROGRAMS; do
+		counts=$WORKERS
+		if [ "$program" = serial ]; then
+			counts=1
+		fi
+		for workers in $counts; do
+			set -- $(bench_measure "$program" "$workers" "$dir")
+			runs=$1
+			seconds=$2
+			if [ "$runs" -eq 0 ]; then
+				echo "$program $size x $size with $workers workers failed, see $dir/run.log"
+				continue
+			fi
+			rate=$(awk -v s="$seconds" -v n="$size" 'BEGIN { printf "%.3f", n * n / 1e6 / s }')
+			echo "$program,$size,$size,$workers,$runs,$seconds,$rate" >> "$OUT"
+			echo "$program $size x $size, $workers workers: $seconds s, $rate MP/s"
+		done
+	done
+done
+echo "Results in $OUT"
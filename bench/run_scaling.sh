@@ -0,0 +1,103 @@
+#!/bin/sh
+#
+# Strong and weak scaling of the OpenMP and the MPI programs.
+# Strong scaling converts the same SIZE x SIZE image with every worker count, the ideal is a time
+# that falls as 1/p. Weak scaling gives every worker the same share of the work, the image is SIZE
+# wide and SIZE * p high, the ideal is a time that stays the same. The times are the medians of
+# REPEATS runs of the total phase of the JSON timings (phase_timer.h), as in run_bench.sh.
+#
+# For every worker count p the CSV file gets:
+#   speedup     T(1) / T(p), for weak scaling p * T(1) / T(p) (the scaled speedup)
+#   efficiency  speedup / p
+#   karp_flatt  (1 / speedup - 1 / p) / (1 - 1 / p), the serial fraction measured by Karp and Flatt.
+#               If it grows with p the parallel overhead grows, if it stays the same the program
+#               is held back by a part that does not run in parallel.
+#   serial_share  e / (e + (1 - e) / p) with e the Karp-Flatt fraction: the share of the time of the
+#               run with p workers taken by the part that does not get faster with more workers. That
+#               part is mostly the serial loading and writing, the omp single that opens the file and
+#               the result in the OpenMP program, the header that process 0 reads and broadcasts in
+#               the MPI program, together with the overhead of the threads and processes. The load and
+#               write phases of the timings are not used for it, most of their time is parallel work
+#               (the collective MPI-IO of all the processes, the encoding of the rows by all the threads).
+#               When serial_share is half or more the line is flagged, and the first worker count where
+#               that happens is printed: from there on more workers hardly help. One worker is never
+#               flagged, there is nothing to compare it with.
+#
+# Run from the top of the repository:  sh bench/run_scaling.sh [scaling.csv]
+# Settings (environment):
+#   SIZE     edge of the image of one worker         default 2048
+#   WORKERS  threads of OpenMP and processes of MPI  default "1 2 4 8", must start with 1
+#   MODES    which scalings run                      default "strong weak"
+#   WARMUP   untimed runs before the timed ones      default 1
+#   REPEATS  timed runs                              default 5
+#   MPIRUN   command that starts the MPI program     default "mpirun -np"
+#   WORKDIR  directory for the binaries and images   default bench_work
+#   PROGRAMS which programs run                      default "openmp mpi"
+
+set -e
+
+OUT=${1:-scaling.csv}
+SIZE=${SIZE:-2048}
+WORKERS=${WORKERS:-"1 2 4 8"}
+MODES=${MODES:-"strong weak"}
+WARMUP=${WARMUP:-1}
+REPEATS=${REPEATS:-5}
+MPIRUN=${MPIRUN:-"mpirun -np"}
+WORKDIR=${WORKDIR:-bench_work}
+PROGRAMS=${PROGRAMS:-"openmp mpi"}
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+
+case "$WORKERS" in
+	1|"1 "*) ;;
+	*) echo "WORKERS must start with 1, the times are compared with the time of one worker"; exit 1 ;;
+esac
+
+mkdir -p "$WORKDIR"
+WORKDIR=$(cd "$WORKDIR" && pwd)
+OUT=$(cd "$(dirname "$OUT")" && pwd)/$(basename "$OUT")
+
+. "$ROOT/bench/bench_lib.sh"
+bench_build
+
+echo "mode,program,width,height,workers,runs,median_seconds,speedup,efficiency,karp_flatt,serial_share,serial_bound" > "$OUT"
+for mode in $MODES; do
+	for program in $PROGRAMS; do
+		base=""
+		flagged=""
+		for workers in $WORKERS; do
+			height=$SIZE
+			if [ "$mode" = weak ]; then
+				height=$((SIZE * workers))
+			fi
+			dir=$(bench_image "$SIZE" "$height")
+			set -- $(bench_measure "$program" "$workers" "$dir")
+			if [ "$1" -eq 0 ]; then
+				echo "$mode $program $SIZE x $height with $workers workers failed, see $dir/run.log"
+				continue
+			fi
+			runs=$1
+			seconds=$2
+			if [ -z "$base" ]; then
+				if [ "$workers" -ne 1 ]; then
+					echo "$mode $program has no time for one worker, nothing to compare with"
+					break
+				fi
+				base=$seconds
+			fi
+			line=$(awk -v mode="$mode" -v t1="$base" -v t="$seconds" -v p="$workers" 'BEGIN {
+				s = (mode == "weak" ? p : 1) * t1 / t
+				kf = p > 1 ? (1 / s - 1 / p) / (1 - 1 / p) : 0
+				serial = kf > 0 ? kf / (kf + (1 - kf) / p) : 0
+				serial = serial > 1 ? 1 : serial
+				printf "%.3f,%.3f,%.4f,%.3f,%d", s, s / p, kf, serial, (p > 1 && serial >= 0.5)
+			}')
+			echo "$mode,$program,$SIZE,$height,$workers,$runs,$seconds,$line" >> "$OUT"
+			echo "$mode $program $SIZE x $height, $workers workers: $seconds s, speedup,efficiency,karp_flatt,serial_share,serial_bound = $line"
+			if [ -z "$flagged" ] && [ "${line##*,}" = 1 ]; then
+				flagged=$workers
+				echo "$mode $program: the part that does not run in parallel takes half of the time or more from $workers workers on"
+			fi
+		done
+	done
+done
+echo "Results in $OUT"
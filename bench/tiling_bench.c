@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../image_buffer.h"
+#include "../stencil.h"
+#include "../tiling.h"
+#include "../perf_counters.h"
+
+/*
+	Benchmark of the traversal order of the convolution.
+	A random gray image of the given size is convoluted with the Laplacian mask in three ways:
+		column-major  the loops of the original programs, the outer loop over the columns
+		row-major     the kernel of stencil.h over whole rows, no tiling
+		tiled         tiles of columns and bands of rows sized from the caches (tiling.h)
+	For every way the time and, where the kernel lets us use them (perf_counters.h), the L1 data
+	cache loads and misses and the last level cache misses are printed. If the counters are not
+	available (no permission, no PMU in a virtual machine) only the times are printed.
+
+	Compile: gcc -O2 -o tiling_bench bench/tiling_bench.c
+	Run:     ./tiling_bench [width] [height] [repetitions]
+*/
+
+static double bench_seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+//The loops of the original programs: column by column, all nine taps for every pixel.
+static void bench_column_major(int h[3][3], const image_buffer* I, const image_buffer* A, int width, int height) {
+	for (int y = 1; y < width - 1; y++) {
+		for (int x = 1; x < height - 1; x++) {
+			int sum = 0;
+			for (int i = -1; i < 2; i++) {
+				for (int j = -1; j < 2; j++) {
+					sum += h[j + 1][i + 1] * image_row8(I, x - j)[y - i];
+				}
+			}
+			image_row16(A, x)[y] = (short)(sum < 0 ? 0 : sum);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	int width = argc > 1 ? atoi(argv[1]) : 16384;
+	int height = argc > 2 ? atoi(argv[2]) : 2048;
+	int repetitions = argc > 3 ? atoi(argv[3]) : 3;
+	int h[3][3] = { {0,1,0},{1,-4,1},{0,1,0} };
+	const char* names[3] = { "column-major", "row-major", "tiled" };
+	image_buffer I;
+	image_buffer A;
+	tile_plan plan;
+	tile_plan untiled;
+	perf_counters counters;
+
+	if (width < 3 || height < 3 || repetitions < 1) {
+		printf("Usage: %s [width >= 3] [height >= 3] [repetitions >= 1]\n", argv[0]);
+		return 1;
+	}
+	if (image_alloc(&I, width, height, 0, 1) != 0 || image_alloc(&A, width, height, 0, 2) != 0) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		return 1;
+	}
+	srand(1);
+	for (int x = 0; x < height; x++) {
+		unsigned char* row = image_row8(&I, x);
+		for (int y = 0; y < width; y++) {
+			row[y] = (unsigned char)(rand() & 0xFF);
+		}
+	}
+
+	tiling_plan(&plan, width);
+	untiled = plan;
+	untiled.tile_cols = width;
+	untiled.band_rows = height;
+	int have_counters = perf_counters_open(&counters) == 0;
+
+	printf("Image %d x %d, kernel %s, L1 %ld KB, L2 %ld KB, tiles of %d columns, bands of %d rows\n",
+		width, height, stencil_kernel_name(), plan.l1_bytes / 1024, plan.l2_bytes / 1024, plan.tile_cols, plan.band_rows);
+	if (!have_counters) {
+		printf("Hardware counters are not available (perf_event_open failed), only the times are printed.\n");
+	}
+	printf("%-14s %12s %14s %14s %12s %14s\n", "traversal", "ms", "L1D loads", "L1D misses", "L1D miss %", "LLC misses");
+
+	for (int way = 0; way < 3; way++) {
+		double best = -1.0;
+		long long values[PERF_COUNTERS] = { -1, -1, -1, -1, -1, -1 };
+		for (int repetition = 0; repetition < repetitions; repetition++) {
+			long long current[PERF_COUNTERS];
+			double start = bench_seconds();
+			perf_counters_reset(&counters);
+			perf_counters_start(&counters);
+			if (way == 0) {
+				bench_column_major(h, &I, &A, width, height);
+			}else {
+				stencil_tiled(h, &I, &A, 1, height - 1, 1, width - 1, way == 1 ? &untiled : &plan);
+			}
+			perf_counters_stop(&counters);
+			perf_counters_read(&counters, current);
+			double elapsed = bench_seconds() - start;
+			//Keep the counters of the fastest repetition.
+			if (best < 0 || elapsed < best) {
+				best = elapsed;
+				memcpy(values, current, sizeof(values));
+			}
+		}
+		if (values[PERF_L1D_LOADS] > 0 && values[PERF_L1D_MISSES] >= 0) {
+			printf("%-14s %12.3f %14lld %14lld %12.2f %14lld\n", names[way], best * 1e3, values[PERF_L1D_LOADS], values[PERF_L1D_MISSES],
+				100.0 * values[PERF_L1D_MISSES] / values[PERF_L1D_LOADS], values[PERF_LLC_MISSES]);
+		}else {
+			printf("%-14s %12.3f %14s %14s %12s %14s\n", names[way], best * 1e3, "n/a", "n/a", "n/a", "n/a");
+		}
+	}
+
+	perf_counters_close(&counters);
+	image_free(&A);
+	image_free(&I);
+	return 0;
+}
@@ -0,0 +1,497 @@
+#ifndef BMP_IO_H
+#define BMP_IO_H
+
+/*
+	Shared BMP loader and writer for the three convolution programs.
+	Instead of calling fread once for every pixel, the whole file is memory-mapped and the
+	grayscale values are computed in one pass straight from the mapped bytes. The loader reads
+	the complete header, respects the 4-byte padding at the end of every row and keeps the sign
+	of the height field, so both bottom-up (positive height) and top-down (negative height)
+	images are handled. Rows are always handed out in image order, row 0 being the top row.
+	The writer works the other way around: whole padded rows are encoded into a batch buffer
+	and the batch goes to the file with a single positioned write, instead of three putc
+	calls for every pixel. For programs whose threads encode rows at the same time there is a
+	result image that holds the whole file and is written once (bmp_result).
+	Everything is defined static inline so that each program keeps compiling on its own.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BMP_IO_X86 1
+#endif
+
+#define BMP_HEADER_SIZE 54
+//Rows are collected until the batch holds about this many bytes and then written at once.
+#define BMP_WRITE_BATCH_BYTES (1 << 20)
+
+typedef struct bmp_image {
+	unsigned char header[BMP_HEADER_SIZE];	//Copy of the first 54 bytes of the file.
+	int width;
+	int height;								//Always positive, the orientation is kept in top_down.
+	int top_down;							//1 when the height field of the header is negative.
+	int bytes_per_pixel;					//3 for 24-bit and 4 for 32-bit images.
+	size_t row_stride;						//Bytes per stored row including the padding.
+	const unsigned char* pixels;			//First byte of the pixel data.
+	unsigned char* map;						//Start of the mapping (or of the buffer on Windows).
+	size_t map_size;
+} bmp_image;
+
+static inline int bmp_read_le32(const unsigned char* p) {
+	return (int)((unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24));
+}
+
+static inline int bmp_read_le16(const unsigned char* p) {
+	return p[0] | (p[1] << 8);
+}
+
+//Size in bytes of one stored row. Every BMP row is padded to a multiple of 4 bytes.
+static inline size_t bmp_row_stride(int width, int bytes_per_pixel) {
+	return ((size_t)width * bytes_per_pixel + 3) & ~(size_t)3;
+}
+
+static inline void bmp_close(bmp_image* bmp) {
+	if (bmp->map) {
+#ifdef _WIN32
+		free(bmp->map);
+#else
+		munmap(bmp->map, bmp->map_size);
+#endif
+	}
+	bmp->map = NULL;
+	bmp->pixels = NULL;
+	bmp->map_size = 0;
+}
+
+/*
+	Map the file and validate its header. Returns 0 on success and -1 on failure, in which case
+	a message has already been printed. Only uncompressed 24-bit and 32-bit images are accepted,
+	which is what the grayscale conversion expects.
+*/
+static inline int bmp_open(bmp_image* bmp, const char* path) {
+	memset(bmp, 0, sizeof(*bmp));
+
+#ifdef _WIN32
+	FILE* fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Cannot open %s. Check if the file is in the same directory as the program exe.\n", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	long file_size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (file_size < BMP_HEADER_SIZE) {
+		printf("%s is too small to be a bmp image.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	bmp->map = (unsigned char*)malloc((size_t)file_size);
+	if (bmp->map == NULL) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		fclose(fp);
+		return -1;
+	}
+	bmp->map_size = fread(bmp->map, 1, (size_t)file_size, fp);
+	fclose(fp);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Cannot open %s. Check if the file is in the same directory as the program exe.\n", path);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < BMP_HEADER_SIZE) {
+		printf("%s is too small to be a bmp image.\n", path);
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		printf("Memory mapping of %s failed.\n", path);
+		return -1;
+	}
+	//The file is read front to back exactly once.
+	madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+	bmp->map = (unsigned char*)map;
+	bmp->map_size = (size_t)st.st_size;
+#endif
+
+	const unsigned char* h = bmp->map;
+	memcpy(bmp->header, h, BMP_HEADER_SIZE);
+
+	int data_offset = bmp_read_le32(&h[10]);
+	int signed_height = bmp_read_le32(&h[22]);
+	int bits = bmp_read_le16(&h[28]);
+	int compression = bmp_read_le32(&h[30]);
+
+	if (h[0] != 'B' || h[1] != 'M' || (bits != 24 && bits != 32) || (compression != 0 && compression != 3)) {
+		printf("Only uncompressed 24-bit or 32-bit bmp images are supported.\n");
+		bmp_close(bmp);
+		return -1;
+	}
+
+	bmp->width = bmp_read_le32(&h[18]);
+	bmp->top_down = signed_height < 0;
+	bmp->height = bmp->top_down ? -signed_height : signed_height;
+	bmp->bytes_per_pixel = bits / 8;
+	bmp->row_stride = bmp_row_stride(bmp->width, bmp->bytes_per_pixel);
+
+	if (bmp->width <= 0 || bmp->height <= 0 || data_offset < BMP_HEADER_SIZE ||
+		(size_t)data_offset + bmp->row_stride * bmp->height > bmp->map_size) {
+		printf("The bmp header does not match the size of the file.\n");
+		bmp_close(bmp);
+		return -1;
+	}
+	bmp->pixels = bmp->map + data_offset;
+	return 0;
+}
+
+static inline void bmp_write_le32(unsigned char* p, int value) {
+	p[0] = (unsigned char)(value & 0xFF);
+	p[1] = (unsigned char)((value >> 8) & 0xFF);
+	p[2] = (unsigned char)((value >> 16) & 0xFF);
+	p[3] = (unsigned char)((value >> 24) & 0xFF);
+}
+
+/*
+	Header for the result image. The input header is copied, so the result keeps the sizes,
+	orientation and resolution of the original, and then it is turned into a plain 24-bit
+	header with the pixel data right after it, because that is what the programs write.
+*/
+static inline void bmp_output_header(const bmp_image* bmp, unsigned char out[BMP_HEADER_SIZE]) {
+	size_t stride = bmp_row_stride(bmp->width, 3);
+	memcpy(out, bmp->header, BMP_HEADER_SIZE);
+	bmp_write_le32(&out[2], (int)(BMP_HEADER_SIZE + stride * bmp->height));
+	bmp_write_le32(&out[10], BMP_HEADER_SIZE);
+	bmp_write_le32(&out[14], 40);
+	out[28] = 24;
+	out[29] = 0;
+	bmp_write_le32(&out[30], 0);
+	bmp_write_le32(&out[34], (int)(stride * bmp->height));
+}
+
+//Row y of the image in image order. For bottom-up files the last stored row is the top one.
+static inline const unsigned char* bmp_row(const bmp_image* bmp, int y) {
+	int stored = bmp->top_down ? y : bmp->height - 1 - y;
+	return bmp->pixels + (size_t)stored * bmp->row_stride;
+}
+
+//Gray values of count pixels of a stored row, for rows that were read from the file by other means.
+static inline void bmp_gray_span(const unsigned char* src, int count, int bytes_per_pixel, unsigned char* dst) {
+	for (int x = 0; x < count; x++) {
+		dst[x] = (unsigned char)((src[0] + src[1] + src[2]) / 3);
+		src += bytes_per_pixel;
+	}
+}
+
+/*
+	Grayscale conversion of the rows [row_start, row_end) straight from the mapped bytes.
+	The gray value is the mean of the three colour values like before. Row y is written at
+	out + (y - row_start) * out_pitch, so the caller decides the layout of the destination.
+*/
+static inline void bmp_gray_rows(const bmp_image* bmp, int row_start, int row_end, unsigned char* out, size_t out_pitch) {
+	for (int y = row_start; y < row_end; y++) {
+		bmp_gray_span(bmp_row(bmp, y), bmp->width, bmp->bytes_per_pixel, out + (size_t)(y - row_start) * out_pitch);
+	}
+}
+
+/*
+	Encoding of one result row. Every value is written three times (blue, green, red) and only
+	its low byte is kept, exactly what the three putc calls did. With SSSE3 sixteen values are
+	narrowed to bytes and spread to 48 BGR bytes with three byte shuffles.
+*/
+static inline void bmp_encode_row16_scalar(const short* src, int width, unsigned char* dst) {
+	for (int x = 0; x < width; x++) {
+		unsigned char v = (unsigned char)src[x];
+		dst[0] = v;
+		dst[1] = v;
+		dst[2] = v;
+		dst += 3;
+	}
+}
+
+#ifdef BMP_IO_X86
+__attribute__((target("ssse3")))
+static inline void bmp_encode_row16_ssse3(const short* src, int width, unsigned char* dst) {
+	const __m128i low_byte = _mm_set1_epi16(0xFF);
+	const __m128i spread0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+	const __m128i spread1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+	const __m128i spread2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + x)), low_byte);
+		__m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + x + 8)), low_byte);
+		__m128i gray = _mm_packus_epi16(a, b);
+		unsigned char* out = dst + 3 * x;
+		_mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(gray, spread0));
+		_mm_storeu_si128((__m128i*)(out + 16), _mm_shuffle_epi8(gray, spread1));
+		_mm_storeu_si128((__m128i*)(out + 32), _mm_shuffle_epi8(gray, spread2));
+	}
+	bmp_encode_row16_scalar(src + x, width - x, dst + 3 * x);
+}
+#endif
+
+static inline void bmp_encode_row16(const short* src, int width, unsigned char* dst) {
+#ifdef BMP_IO_X86
+	if (__builtin_cpu_supports("ssse3")) {
+		bmp_encode_row16_ssse3(src, width, dst);
+		return;
+	}
+#endif
+	bmp_encode_row16_scalar(src, width, dst);
+}
+
+/*
+	Batched writer for the result image. The batch is a window of consecutive stored rows with
+	their padding. Rows may be handed in top to bottom even when the file is bottom-up: the
+	window is then filled from its end, so the filled part is always one contiguous piece of
+	the file and goes out with a single pwrite.
+*/
+typedef struct bmp_writer {
+	int fd;
+	int width;
+	int height;
+	int top_down;
+	size_t row_stride;
+	unsigned char* batch;
+	int batch_rows;
+	int base;		//Stored row that goes to the first slot of the batch.
+	int first;		//Filled stored rows are [first, last], first > last means empty.
+	int last;
+} bmp_writer;
+
+static inline int bmp_pwrite(int fd, const unsigned char* data, size_t size, size_t offset) {
+	while (size > 0) {
+#ifdef _WIN32
+		if (_lseeki64(fd, (long long)offset, SEEK_SET) < 0) {
+			return -1;
+		}
+		int done = _write(fd, data, (unsigned int)(size > (1u << 30) ? (1u << 30) : size));
+#else
+		ssize_t done = pwrite(fd, data, size, (off_t)offset);
+#endif
+		if (done <= 0) {
+			return -1;
+		}
+		data += done;
+		size -= (size_t)done;
+		offset += (size_t)done;
+	}
+	return 0;
+}
+
+static inline int bmp_writer_flush(bmp_writer* w) {
+	if (w->first > w->last) {
+		return 0;
+	}
+	size_t offset = BMP_HEADER_SIZE + (size_t)w->first * w->row_stride;
+	const unsigned char* data = w->batch + (size_t)(w->first - w->base) * w->row_stride;
+	int status = bmp_pwrite(w->fd, data, (size_t)(w->last - w->first + 1) * w->row_stride, offset);
+	w->first = 1;
+	w->last = 0;
+	return status;
+}
+
+/*
+	Create the result file, write the header made by bmp_output_header and allocate the batch.
+	The sizes and the orientation are taken from that header. Returns 0 on success and -1 on
+	failure after printing a message.
+*/
+static inline int bmp_writer_open(bmp_writer* w, const char* path, const unsigned char header[BMP_HEADER_SIZE]) {
+	int signed_height = bmp_read_le32(&header[22]);
+	memset(w, 0, sizeof(*w));
+	w->width = bmp_read_le32(&header[18]);
+	w->top_down = signed_height < 0;
+	w->height = w->top_down ? -signed_height : signed_height;
+	w->row_stride = bmp_row_stride(w->width, 3);
+	w->batch_rows = (int)(BMP_WRITE_BATCH_BYTES / w->row_stride);
+	if (w->batch_rows < 1) {
+		w->batch_rows = 1;
+	}
+	if (w->batch_rows > w->height) {
+		w->batch_rows = w->height;
+	}
+	w->first = 1;
+	w->last = 0;
+	w->batch = (unsigned char*)malloc((size_t)w->batch_rows * w->row_stride);
+	if (w->batch == NULL) {
+		printf("Malloc allocation failed. Terminating program...\n");
+		return -1;
+	}
+#ifdef _WIN32
+	w->fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (w->fd < 0) {
+		printf("The file %s could not be openned or created.\n", path);
+		free(w->batch);
+		w->batch = NULL;
+		return -1;
+	}
+	if (bmp_pwrite(w->fd, header, BMP_HEADER_SIZE, 0) != 0) {
+		printf("Writing to %s failed.\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+//Slot in the batch for image row y. The padding bytes of the row are already zero.
+static inline unsigned char* bmp_writer_row(bmp_writer* w, int y) {
+	int stored = w->top_down ? y : w->height - 1 - y;
+	int outside = stored < w->base || stored >= w->base + w->batch_rows;
+	//A gap inside the window would be written as garbage, so it also starts a new batch.
+	int gap = w->first <= w->last && (stored < w->first - 1 || stored > w->last + 1);
+	if (outside || gap) {
+		bmp_writer_flush(w);
+		if (w->top_down) {
+			w->base = stored + w->batch_rows > w->height ? w->height - w->batch_rows : stored;
+		}else {
+			w->base = stored - w->batch_rows + 1 < 0 ? 0 : stored - w->batch_rows + 1;
+		}
+	}
+	if (w->first > w->last) {
+		w->first = stored;
+		w->last = stored;
+	}else if (stored < w->first) {
+		w->first = stored;
+	}else if (stored > w->last) {
+		w->last = stored;
+	}
+	unsigned char* row = w->batch + (size_t)(stored - w->base) * w->row_stride;
+	memset(row + (size_t)w->width * 3, 0, w->row_stride - (size_t)w->width * 3);
+	return row;
+}
+
+static inline void bmp_writer_put_row16(bmp_writer* w, int y, const short* src) {
+	bmp_encode_row16(src, w->width, bmp_writer_row(w, y));
+}
+
+//Write what is left in the batch and close the file. Returns 0 on success.
+static inline int bmp_writer_close(bmp_writer* w) {
+	int status = bmp_writer_flush(w);
+#ifdef _WIN32
+	_close(w->fd);
+#else
+	if (close(w->fd) != 0) {
+		status = -1;
+	}
+#endif
+	free(w->batch);
+	w->batch = NULL;
+	return status;
+}
+
+/*
+	Result image that is filled by many threads at once. The whole file (the header and every
+	padded row) is one block of memory in which every image row has its fixed place, so threads
+	can encode different rows at the same time without any ordering between them. Where it is
+	possible the block is the file itself, mapped into memory (mmap), and the rows reach the file
+	without another copy. Otherwise the block is allocated and goes to the file with a single
+	pwrite when it is closed.
+*/
+typedef struct bmp_result {
+	int fd;
+	int width;
+	int height;
+	int top_down;
+	size_t row_stride;
+	unsigned char* data;	//Header and rows as they are stored in the file.
+	size_t size;
+	int mapped;				//1 when data is the mapped file.
+} bmp_result;
+
+/*
+	Create the result file with the header made by bmp_output_header and room for all the rows.
+	Returns 0 on success and -1 on failure after printing a message.
+*/
+static inline int bmp_result_open(bmp_result* r, const char* path, const unsigned char header[BMP_HEADER_SIZE]) {
+	int signed_height = bmp_read_le32(&header[22]);
+	memset(r, 0, sizeof(*r));
+	r->width = bmp_read_le32(&header[18]);
+	r->top_down = signed_height < 0;
+	r->height = r->top_down ? -signed_height : signed_height;
+	r->row_stride = bmp_row_stride(r->width, 3);
+	r->size = BMP_HEADER_SIZE + r->row_stride * r->height;
+#ifdef _WIN32
+	r->fd = _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (r->fd < 0) {
+		printf("The file %s could not be openned or created.\n", path);
+		return -1;
+	}
+#ifndef _WIN32
+	if (ftruncate(r->fd, (off_t)r->size) == 0) {
+		void* map = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+		if (map != MAP_FAILED) {
+			r->data = (unsigned char*)map;
+			r->mapped = 1;
+		}
+	}
+#endif
+	if (r->data == NULL) {
+		r->data = (unsigned char*)malloc(r->size);
+		if (r->data == NULL) {
+			printf("Malloc allocation failed. Terminating program...\n");
+#ifdef _WIN32
+			_close(r->fd);
+#else
+			close(r->fd);
+#endif
+			return -1;
+		}
+	}
+	memcpy(r->data, header, BMP_HEADER_SIZE);
+	return 0;
+}
+
+//Encode image row y with its zero padding. Different rows can be encoded by different threads at the same time.
+static inline void bmp_result_put_row16(bmp_result* r, int y, const short* src) {
+	int stored = r->top_down ? y : r->height - 1 - y;
+	unsigned char* row = r->data + BMP_HEADER_SIZE + (size_t)stored * r->row_stride;
+	bmp_encode_row16(src, r->width, row);
+	memset(row + (size_t)r->width * 3, 0, r->row_stride - (size_t)r->width * 3);
+}
+
+//Write the rows if they are not mapped and close the file. Returns 0 on success.
+static inline int bmp_result_close(bmp_result* r) {
+	int status = 0;
+#ifndef _WIN32
+	if (r->mapped) {
+		status = munmap(r->data, r->size);
+	}
+	else
+#endif
+	{
+		status = bmp_pwrite(r->fd, r->data, r->size, 0);
+		free(r->data);
+	}
+#ifdef _WIN32
+	_close(r->fd);
+#else
+	if (close(r->fd) != 0) {
+		status = -1;
+	}
+#endif
+	r->data = NULL;
+	return status;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef IMAGE_BUFFER_H
+#define IMAGE_BUFFER_H
+
+/*
+	Image type shared by the three convolution programs.
+	The old int** arrays made one malloc per row, so the rows were scattered around the heap and
+	every access of the stencil went through a row pointer first. Here the whole image is one
+	aligned allocation. Rows follow each other at a fixed distance (the pitch), so the memory is
+	linear for the prefetchers and the vectorizers. Optional halo rows and columns surround the
+	image, so that a block of the image can hold the neighbouring rows it needs for the convolution.
+	Pixels are stored with 8 bits (gray values) or 16 bits (convolution results) instead of int.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Alignment of the allocation and of the first pixel of every row. It is the size of a cache line.
+#define IMAGE_ALIGN 64
+
+typedef struct image_buffer {
+	unsigned char* data;	//Start of the allocation.
+	int width;
+	int height;
+	int halo;				//Rows above and below and columns left and right of the image.
+	int bytes_per_pixel;	//1 for unsigned char pixels, 2 for short pixels.
+	size_t pitch;			//Bytes from one row to the next, a multiple of IMAGE_ALIGN.
+	size_t origin;			//Bytes from the start of the allocation to pixel (0, 0).
+} image_buffer;
+
+static inline size_t image_round_up(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+/*
+	Allocate a width x height image with the given halo without writing to it. The operating system
+	places a page on the NUMA node of the thread that writes it first, so a parallel program can let
+	every thread fill the rows it works on later and they end up in its own memory. Every byte of the
+	rows (pitch bytes each, the halo rows included) has to be written before it is read.
+	Returns 0 on success and -1 on failure.
+	The first pixel of every row is aligned to IMAGE_ALIGN, the left halo is placed right before it.
+*/
+static inline int image_alloc_untouched(image_buffer* img, int width, int height, int halo, int bytes_per_pixel) {
+	size_t left = halo > 0 ? image_round_up((size_t)halo * bytes_per_pixel, IMAGE_ALIGN) : 0;
+	memset(img, 0, sizeof(*img));
+	img->width = width;
+	img->height = height;
+	img->halo = halo;
+	img->bytes_per_pixel = bytes_per_pixel;
+	img->pitch = image_round_up(left + (size_t)(width + halo) * bytes_per_pixel, IMAGE_ALIGN);
+	img->origin = (size_t)halo * img->pitch + left;
+
+	size_t size = img->pitch * (size_t)(height + 2 * halo);
+	if (size == 0) {
+		size = IMAGE_ALIGN;
+	}
+#ifdef _WIN32
+	img->data = (unsigned char*)_aligned_malloc(size, IMAGE_ALIGN);
+#else
+	void* data = NULL;
+	if (posix_memalign(&data, IMAGE_ALIGN, size) != 0) {
+		data = NULL;
+	}
+	img->data = (unsigned char*)data;
+#endif
+	return img->data == NULL ? -1 : 0;
+}
+
+/*
+	Allocate a width x height image with the given halo and fill it with zeros, so that the halo
+	and the edges act as the zero border of the convolution. Returns 0 on success and -1 on failure.
+*/
+static inline int image_alloc(image_buffer* img, int width, int height, int halo, int bytes_per_pixel) {
+	if (image_alloc_untouched(img, width, height, halo, bytes_per_pixel) != 0) {
+		return -1;
+	}
+	memset(img->data, 0, img->pitch * (size_t)(height + 2 * halo));
+	return 0;
+}
+
+static inline void image_free(image_buffer* img) {
+#ifdef _WIN32
+	_aligned_free(img->data);
+#else
+	free(img->data);
+#endif
+	img->data = NULL;
+}
+
+/*
+	Describe pixels that live in memory owned by someone else (a shared window, a part of a bigger
+	image) as an image. pixels is pixel (0, 0) and the rows are pitch bytes apart. The rows and
+	columns around it are whatever the memory holds there, so a view of a block of an image sees the
+	neighbouring pixels as its halo. A wrapped image must not be given to image_free.
+*/
+static inline void image_wrap(image_buffer* img, void* pixels, int width, int height, size_t pitch, int bytes_per_pixel) {
+	memset(img, 0, sizeof(*img));
+	img->data = (unsigned char*)pixels;
+	img->width = width;
+	img->height = height;
+	img->bytes_per_pixel = bytes_per_pixel;
+	img->pitch = pitch;
+}
+
+//Row y of an 8-bit image. Rows -halo .. height + halo - 1 are valid, index -1 of a row is its left halo.
+static inline unsigned char* image_row8(const image_buffer* img, int y) {
+	return img->data + img->origin + (ptrdiff_t)y * (ptrdiff_t)img->pitch;
+}
+
+//Row y of a 16-bit image.
+static inline short* image_row16(const image_buffer* img, int y) {
+	return (short*)(img->data + img->origin + (ptrdiff_t)y * (ptrdiff_t)img->pitch);
+}
+
+#endif
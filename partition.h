@@ -0,0 +1,20 @@
+#ifndef PARTITION_H
+#define PARTITION_H
+
+/*
+	Row partitioner shared by the MPI and OpenMP programs.
+	The rows of the image are split into p blocks of consecutive rows. When p does not divide the
+	count of rows, the first (rows % p) blocks get one row more than the others, so the blocks never
+	differ by more than one row and no rows have to be added to the image. This is the same split
+	the static schedule of OpenMP makes without a chunk size.
+*/
+
+//First and one-past-last element of block index out of parts blocks of total elements.
+static inline void partition_block(int total, int parts, int index, int* begin, int* end) {
+	int base = total / parts;
+	int extra = total % parts;
+	*begin = index * base + (index < extra ? index : extra);
+	*end = *begin + base + (index < extra ? 1 : 0);
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+/*
+	Hardware performance counters of the calling thread (perf_event_open on Linux).
+	The times of the phases tell how long the convolution took but not why. The counters of the
+	processor tell it: the cycles and instructions give the instructions per cycle, the loads and
+	misses of the L1 data cache and the misses of the last level cache show how well the tiles fit,
+	and every last level cache miss brings one cache line from memory, so the misses per pixel give
+	the bytes of memory traffic per pixel. The counters are opened as one group so they all count
+	over the same time, and only count in user space, which an unprivileged process may do.
+	A counter of vector instructions has no common name on all processors, so it is only opened when
+	STENCIL_PERF_VECTOR gives the code of such a raw event of the CPU (see the manual of the CPU or
+	perf list --details). A counter that cannot be opened (no permission, no PMU in a virtual machine,
+	not Linux) reads -1 and what is derived from it is not printed.
+	The programs only open the counters when the environment variable STENCIL_PERF is 1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_L1D_LOADS,
+	PERF_L1D_MISSES,
+	PERF_LLC_MISSES,
+	PERF_VECTOR,		//Raw event of STENCIL_PERF_VECTOR.
+	PERF_COUNTERS
+};
+
+//Bytes brought from memory by one last level cache miss.
+#define PERF_LINE_BYTES 64
+
+typedef struct perf_counters {
+	int fd[PERF_COUNTERS];
+	int leader;			//Index of the counter that leads the group, -1 if none could be opened.
+} perf_counters;
+
+//1 if the counters were asked for with STENCIL_PERF=1.
+static inline int perf_counters_requested(void) {
+	const char* value = getenv("STENCIL_PERF");
+	return value != NULL && atoi(value) != 0;
+}
+
+#ifdef __linux__
+static inline int perf_counters_open_one(unsigned int type, unsigned long long config, int group) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group == -1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	//The times let a group that had to share the PMU with others be scaled to the whole time.
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/*
+	Open the counters of the calling thread as one group, they start stopped. The first counter that
+	opens leads the group. Returns 0 or -1 if no counter could be opened.
+*/
+static inline int perf_counters_open(perf_counters* c) {
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		c->fd[i] = -1;
+	}
+	c->leader = -1;
+#ifdef __linux__
+	unsigned long long l1d = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8);
+	unsigned int types[PERF_COUNTERS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_RAW };
+	unsigned long long configs[PERF_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		l1d | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16),
+		l1d | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_MISSES,
+		0
+	};
+	const char* vector = getenv("STENCIL_PERF_VECTOR");
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (i == PERF_VECTOR) {
+			if (vector == NULL || vector[0] == '\0') {
+				continue;
+			}
+			configs[i] = strtoull(vector, NULL, 0);
+		}
+		c->fd[i] = perf_counters_open_one(types[i], configs[i], c->leader == -1 ? -1 : c->fd[c->leader]);
+		if (c->fd[i] >= 0 && c->leader == -1) {
+			c->leader = i;
+		}
+	}
+#endif
+	return c->leader == -1 ? -1 : 0;
+}
+
+//Set all the counters of the group to zero.
+static inline void perf_counters_reset(perf_counters* c) {
+#ifdef __linux__
+	if (c->leader >= 0) {
+		ioctl(c->fd[c->leader], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	}
+#else
+	(void)c;
+#endif
+}
+
+//Start or go on counting. A group can be stopped and started again to leave out a part.
+static inline void perf_counters_start(perf_counters* c) {
+#ifdef __linux__
+	if (c->leader >= 0) {
+		ioctl(c->fd[c->leader], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#else
+	(void)c;
+#endif
+}
+
+static inline void perf_counters_stop(perf_counters* c) {
+#ifdef __linux__
+	if (c->leader >= 0) {
+		ioctl(c->fd[c->leader], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+	}
+#else
+	(void)c;
+#endif
+}
+
+//Read the counters, a counter that could not be opened or never ran reads -1.
+static inline void perf_counters_read(const perf_counters* c, long long values[PERF_COUNTERS]) {
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		values[i] = -1;
+#ifdef __linux__
+		unsigned long long data[3];		//Value, time enabled and time running.
+		if (c->fd[i] >= 0 && read(c->fd[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0) {
+			values[i] = data[2] < data[1] ? (long long)((double)data[0] * data[1] / data[2]) : (long long)data[0];
+		}
+#endif
+	}
+}
+
+static inline void perf_counters_close(perf_counters* c) {
+#ifdef __linux__
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		if (c->fd[i] >= 0) {
+			close(c->fd[i]);
+		}
+		c->fd[i] = -1;
+	}
+#endif
+	c->leader = -1;
+}
+
+//Add the values of one thread to the total of a process, a counter is -1 if one of the threads could not read it.
+static inline void perf_counters_add(long long total[PERF_COUNTERS], const long long values[PERF_COUNTERS]) {
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		total[i] = total[i] < 0 || values[i] < 0 ? -1 : total[i] + values[i];
+	}
+}
+
+/*
+	Print what the counters of a thread or a process say about the pixels it convoluted, e.g.
+	| Counters of thread 2: 1.84 IPC, L1D miss 1.20 %, LLC 0.35 misses/1000 instructions, 3.10 bytes/pixel |
+	The bytes per pixel are the cache lines brought from memory, a kernel that reads every pixel once
+	and writes it once needs 3 bytes per pixel (1 byte of I and 2 of A).
+*/
+static inline void perf_counters_print(const char* who, int id, const long long values[PERF_COUNTERS], long long pixels) {
+	char line[512];
+	int used = snprintf(line, sizeof(line), "| Counters of %s %d:", who, id);
+	if (values[PERF_CYCLES] > 0 && values[PERF_INSTRUCTIONS] >= 0) {
+		used += snprintf(line + used, sizeof(line) - used, " %.2f IPC,", (double)values[PERF_INSTRUCTIONS] / values[PERF_CYCLES]);
+	}
+	if (values[PERF_L1D_LOADS] > 0 && values[PERF_L1D_MISSES] >= 0) {
+		used += snprintf(line + used, sizeof(line) - used, " L1D miss %.2f %%,", 100.0 * values[PERF_L1D_MISSES] / values[PERF_L1D_LOADS]);
+	}
+	if (values[PERF_INSTRUCTIONS] > 0 && values[PERF_LLC_MISSES] >= 0) {
+		used += snprintf(line + used, sizeof(line) - used, " LLC %.2f misses/1000 instructions,", 1000.0 * values[PERF_LLC_MISSES] / values[PERF_INSTRUCTIONS]);
+	}
+	if (pixels > 0 && values[PERF_LLC_MISSES] >= 0) {
+		used += snprintf(line + used, sizeof(line) - used, " %.2f bytes/pixel,", (double)PERF_LINE_BYTES * values[PERF_LLC_MISSES] / pixels);
+	}
+	if (pixels > 0 && values[PERF_VECTOR] >= 0) {
+		used += snprintf(line + used, sizeof(line) - used, " %.3f vector instructions/pixel,", (double)values[PERF_VECTOR] / pixels);
+	}
+	if (line[used - 1] == ',') {
+		line[used - 1] = '\0';
+		printf("%s |\n", line);
+	}
+	else {
+		printf("%s not available |\n", line);
+	}
+}
+
+#endif
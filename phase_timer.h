@@ -0,0 +1,157 @@
+#ifndef PHASE_TIMER_H
+#define PHASE_TIMER_H
+
+/*
+	Phase timer shared by the three convolution programs.
+	clock() counts the processor time of the process, which is not the time the user waits: it
+	misses the time spent waiting for the disk and the network and it adds up the time of all the
+	threads. Here the elapsed time is read from a monotonic clock, which is not moved by changes of
+	the system time, and it is kept apart for every phase of the program: loading the file, the
+	grayscale conversion, the decomposition of the image, the halo exchange, the convolution, the
+	gathering of the results and the writing of the file. A program only reports the phases it has.
+	The times of several threads or processes are reduced to their minimum, mean and maximum and
+	printed as one line of JSON, or written to the file named by STENCIL_TIMINGS.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+enum {
+	PHASE_LOAD,
+	PHASE_GRAYSCALE,
+	PHASE_DECOMPOSE,
+	PHASE_HALO,
+	PHASE_CONVOLVE,
+	PHASE_GATHER,
+	PHASE_WRITE,
+	PHASE_TOTAL,		//From phase_timer_start to phase_timer_stop.
+	PHASE_COUNT
+};
+
+static inline const char* phase_name(int phase) {
+	switch (phase) {
+	case PHASE_LOAD: return "load";
+	case PHASE_GRAYSCALE: return "grayscale";
+	case PHASE_DECOMPOSE: return "decompose";
+	case PHASE_HALO: return "halo";
+	case PHASE_CONVOLVE: return "convolve";
+	case PHASE_GATHER: return "gather";
+	case PHASE_WRITE: return "write";
+	default: return "total";
+	}
+}
+
+//Seconds from a fixed point in the past, read from a monotonic clock.
+static inline double phase_now(void) {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+typedef struct phase_timer {
+	double seconds[PHASE_COUNT];
+	int used[PHASE_COUNT];		//1 for the phases the program has.
+	double begin;
+	double mark;				//End of the last lap.
+} phase_timer;
+
+static inline void phase_timer_start(phase_timer* t) {
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		t->seconds[i] = 0.0;
+		t->used[i] = 0;
+	}
+	t->begin = phase_now();
+	t->mark = t->begin;
+}
+
+//Add the time since the last lap to phase. A phase can be timed in several laps.
+static inline void phase_timer_lap(phase_timer* t, int phase) {
+	double now = phase_now();
+	t->seconds[phase] += now - t->mark;
+	t->used[phase] = 1;
+	t->mark = now;
+}
+
+static inline void phase_timer_stop(phase_timer* t) {
+	t->mark = phase_now();
+	t->seconds[PHASE_TOTAL] = t->mark - t->begin;
+	t->used[PHASE_TOTAL] = 1;
+}
+
+//Minimum, mean and maximum of every phase over the threads or processes that timed it.
+typedef struct phase_stats {
+	double min[PHASE_COUNT];
+	double mean[PHASE_COUNT];
+	double max[PHASE_COUNT];
+	int used[PHASE_COUNT];
+} phase_stats;
+
+//Statistics of a single timer, the minimum, the mean and the maximum are all the same.
+static inline void phase_stats_from_timer(phase_stats* s, const phase_timer* t) {
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		s->min[i] = t->seconds[i];
+		s->mean[i] = t->seconds[i];
+		s->max[i] = t->seconds[i];
+		s->used[i] = t->used[i];
+	}
+}
+
+//Replace one phase with the statistics of count values, one for every thread.
+static inline void phase_stats_set(phase_stats* s, int phase, const double* values, int count) {
+	double sum = 0.0;
+	s->min[phase] = count > 0 ? values[0] : 0.0;
+	s->max[phase] = s->min[phase];
+	for (int i = 0; i < count; i++) {
+		sum += values[i];
+		s->min[phase] = values[i] < s->min[phase] ? values[i] : s->min[phase];
+		s->max[phase] = values[i] > s->max[phase] ? values[i] : s->max[phase];
+	}
+	s->mean[phase] = count > 0 ? sum / count : 0.0;
+	s->used[phase] = 1;
+}
+
+/*
+	Print the statistics as one line of JSON, e.g.
+	{"program":"mpi","width":640,"height":480,"processes":4,"threads":1,"clock":"monotonic",
+	 "phases":{"load":{"min":0.001,"mean":0.002,"max":0.003},...,"total":{...}}}
+	The times are in seconds. If STENCIL_TIMINGS names a file the line is written there instead.
+*/
+static inline void phase_stats_json(const phase_stats* s, const char* program, int width, int height, int processes, int threads) {
+	const char* path = getenv("STENCIL_TIMINGS");
+	FILE* out = stdout;
+	if (path != NULL && path[0] != '\0') {
+		out = fopen(path, "w");
+		if (out == NULL) {
+			printf("The file %s could not be openned or created.\n", path);
+			return;
+		}
+	}
+	fprintf(out, "{\"program\":\"%s\",\"width\":%d,\"height\":%d,\"processes\":%d,\"threads\":%d,\"clock\":\"monotonic\",\"phases\":{",
+		program, width, height, processes, threads);
+	int first = 1;
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		if (s->used[i]) {
+			fprintf(out, "%s\"%s\":{\"min\":%.9f,\"mean\":%.9f,\"max\":%.9f}", first ? "" : ",", phase_name(i), s->min[i], s->mean[i], s->max[i]);
+			first = 0;
+		}
+	}
+	fprintf(out, "}}\n");
+	if (out != stdout) {
+		fclose(out);
+	}
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/*
+	Streaming row pipeline: grayscale -> convolve -> clamp -> encode in a single pass.
+	Instead of making a full pass over the image for every step (read, copy, zero A, convolve,
+	clamp, write), the rows go through all the steps one after the other while they are still in
+	the cache. The image is processed in bands of rows sized from the L2 cache (tiling.h): the rows
+	of a band are converted to gray values, convolved tile by tile (the kernel also clamps) and
+	encoded straight into the batch of the writer. The two gray rows the next band shares with the
+	current one are moved to its top instead of being converted again. Besides the batch of the
+	writer only one band of gray rows and results is allocated, so the memory needed grows with
+	the width of the image and not with its size.
+*/
+
+#include "bmp_io.h"
+#include "image_buffer.h"
+#include "stencil.h"
+#include "tiling.h"
+#include "phase_timer.h"
+#include "perf_counters.h"
+
+/*
+	Convolve the rows [row_begin, row_end) of the image and hand them to the writer.
+	The first and the last row of the image and the first and last column of every row stay
+	zero like in the other programs. Returns 0 on success and -1 if an allocation failed.
+	If timer is not NULL the time of every band is added to the grayscale, convolve and write phases.
+	If counters is not NULL they count the convolution of every band and nothing else (perf_counters.h).
+*/
+static inline int pipeline_run(const bmp_image* bmp, bmp_writer* writer, int h[3][3], int row_begin, int row_end, const tile_plan* plan, phase_timer* timer, perf_counters* counters) {
+	int width = bmp->width;
+	int height = bmp->height;
+	int band = plan->band_rows < row_end - row_begin ? plan->band_rows : row_end - row_begin;
+	image_buffer window;
+	image_buffer result;
+
+	//Gray rows of a band with one halo row above and below, and the results of the band.
+	if (band < 1) {
+		band = 1;
+	}
+	if (image_alloc(&window, width, band, 1, 1) != 0) {
+		return -1;
+	}
+	if (image_alloc(&result, width, band, 0, 2) != 0) {
+		image_free(&window);
+		return -1;
+	}
+
+	//Row r of the image is row r - start of the window and of the result. n is the size of the band.
+	int n = 0;
+	for (int start = row_begin; start < row_end; start += n) {
+		int from = start - 1;
+		if (start > row_begin) {
+			//The last two rows of the previous band are the rows start - 1 and start.
+			memmove(image_row8(&window, -1), image_row8(&window, n - 1), 2 * window.pitch);
+			from = start + 1;
+		}
+		n = row_end - start < band ? row_end - start : band;
+
+		//Convert the rows [from, start + n] that are inside the image, the others are zero rows.
+		int first = from < 0 ? 0 : from;
+		int last = start + n > height - 1 ? height - 1 : start + n;
+		if (first <= last) {
+			bmp_gray_rows(bmp, first, last + 1, image_row8(&window, first - start), window.pitch);
+		}
+		for (int r = from; r <= start + n; r++) {
+			if (r < 0 || r > height - 1) {
+				memset(image_row8(&window, r - start), 0, width);
+			}
+		}
+		if (timer) {
+			phase_timer_lap(timer, PHASE_GRAYSCALE);
+		}
+
+		int conv_begin = start < 1 ? 1 : start;
+		int conv_end = start + n > height - 1 ? height - 1 : start + n;
+		if (counters) {
+			perf_counters_start(counters);
+		}
+		stencil_tiled(h, &window, &result, conv_begin - start, conv_end - start, 1, width - 1, plan);
+		if (counters) {
+			perf_counters_stop(counters);
+		}
+		if (timer) {
+			phase_timer_lap(timer, PHASE_CONVOLVE);
+		}
+		for (int x = start; x < start + n; x++) {
+			if (x == 0 || x == height - 1) {
+				memset(image_row16(&result, x - start), 0, (size_t)width * sizeof(short));
+			}
+			bmp_writer_put_row16(writer, x, image_row16(&result, x - start));
+		}
+		if (timer) {
+			phase_timer_lap(timer, PHASE_WRITE);
+		}
+	}
+
+	image_free(&result);
+	image_free(&window);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+
+/*
+	3x3 convolution kernels shared by the three programs.
+	A kernel computes one row of the A array from three rows of the I array (the row above, the row
+	itself and the row below) and turns negative results into zeros while storing them, so the
+	clamp no longer needs its own pass over A. Like in the convolution equation the mask is flipped:
+	h[a][b] multiplies I[x + 1 - a][y + 1 - b].
+
+	The Laplacian mask { {0,1,0},{1,-4,1},{0,1,0} } is specialized at compile time. Its taps are
+	constants, so the four zero taps disappear, the ones become plain additions and the -4 center
+	becomes a shift, which leaves 5 loads and 4 additions per pixel instead of 9 multiply-adds.
+	In C++ the specialization is the stencil_mask template, in C the same loop is expanded with
+	the constant taps. Any other mask goes through the generic kernel.
+
+	The Laplacian also has vectorized kernels for SSE4.1 (16 pixels per iteration), AVX2 (32) and
+	AVX-512 (64). They load the neighbours of a whole run of pixels with unaligned loads, widen the
+	bytes to 16 bits, and clamp with a max against zero before the store. The best one the CPU
+	supports is picked at run time, the scalar kernel is the fallback. The environment variable
+	STENCIL_ISA (scalar, sse41, avx2 or avx512) limits the choice, which is useful for comparisons.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define STENCIL_X86 1
+#endif
+
+//One tap with a constant coefficient. The comparisons are resolved by the compiler.
+#define STENCIL_TAP(k, v) \
+	((k) == 0 ? 0 : (k) == 1 ? (v) : (k) == -1 ? -(v) : \
+	 (k) == 2 ? (v) << 1 : (k) == -2 ? -((v) << 1) : \
+	 (k) == 4 ? (v) << 2 : (k) == -4 ? -((v) << 2) : (k) * (v))
+
+//Convolution of pixel y of the middle row with constant taps.
+#define STENCIL_3X3_PIXEL(up, mid, down, y, h00, h01, h02, h10, h11, h12, h20, h21, h22) \
+	(STENCIL_TAP(h00, (int)(down)[(y) + 1]) + STENCIL_TAP(h01, (int)(down)[y]) + STENCIL_TAP(h02, (int)(down)[(y) - 1]) + \
+	 STENCIL_TAP(h10, (int)(mid)[(y) + 1]) + STENCIL_TAP(h11, (int)(mid)[y]) + STENCIL_TAP(h12, (int)(mid)[(y) - 1]) + \
+	 STENCIL_TAP(h20, (int)(up)[(y) + 1]) + STENCIL_TAP(h21, (int)(up)[y]) + STENCIL_TAP(h22, (int)(up)[(y) - 1]))
+
+//Loop over the pixels [y_begin, y_end) of a row with constant taps, negative values become zero.
+#define STENCIL_3X3_ROW_LOOP(up, mid, down, out, y_begin, y_end, h00, h01, h02, h10, h11, h12, h20, h21, h22) \
+	for (int y_ = (y_begin); y_ < (y_end); y_++) { \
+		int sum_ = STENCIL_3X3_PIXEL(up, mid, down, y_, h00, h01, h02, h10, h11, h12, h20, h21, h22); \
+		(out)[y_] = (short)(sum_ < 0 ? 0 : sum_); \
+	}
+
+#ifdef __cplusplus
+template <int H00, int H01, int H02, int H10, int H11, int H12, int H20, int H21, int H22>
+struct stencil_mask {
+	static inline void row(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+		STENCIL_3X3_ROW_LOOP(up, mid, down, out, y_begin, y_end, H00, H01, H02, H10, H11, H12, H20, H21, H22)
+	}
+};
+
+typedef stencil_mask<0, 1, 0, 1, -4, 1, 0, 1, 0> stencil_laplacian_mask;
+
+static inline void stencil_laplacian_row(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	stencil_laplacian_mask::row(up, mid, down, out, y_begin, y_end);
+}
+#else
+static inline void stencil_laplacian_row(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	STENCIL_3X3_ROW_LOOP(up, mid, down, out, y_begin, y_end, 0, 1, 0, 1, -4, 1, 0, 1, 0)
+}
+#endif
+
+typedef void (*stencil_row_fn)(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end);
+
+#ifdef STENCIL_X86
+/*
+	The vector kernels read mid[y - 1] up to mid[y + width of the vector], so like the scalar kernel
+	they need y_begin >= 1 and y_end <= row length - 1. What is left at the end of a row is done by
+	the scalar kernel.
+*/
+__attribute__((target("sse4.1")))
+static inline void stencil_laplacian_row_sse41(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	const __m128i zero = _mm_setzero_si128();
+	int y = y_begin;
+	for (; y + 16 <= y_end; y += 16) {
+		__m128i u = _mm_loadu_si128((const __m128i*)(up + y));
+		__m128i d = _mm_loadu_si128((const __m128i*)(down + y));
+		__m128i l = _mm_loadu_si128((const __m128i*)(mid + y - 1));
+		__m128i r = _mm_loadu_si128((const __m128i*)(mid + y + 1));
+		__m128i c = _mm_loadu_si128((const __m128i*)(mid + y));
+		__m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_cvtepu8_epi16(u), _mm_cvtepu8_epi16(d)),
+			_mm_add_epi16(_mm_cvtepu8_epi16(l), _mm_cvtepu8_epi16(r)));
+		__m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(u, zero), _mm_unpackhi_epi8(d, zero)),
+			_mm_add_epi16(_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero)));
+		lo = _mm_sub_epi16(lo, _mm_slli_epi16(_mm_cvtepu8_epi16(c), 2));
+		hi = _mm_sub_epi16(hi, _mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 2));
+		_mm_storeu_si128((__m128i*)(out + y), _mm_max_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*)(out + y + 8), _mm_max_epi16(hi, zero));
+	}
+	stencil_laplacian_row(up, mid, down, out, y, y_end);
+}
+
+__attribute__((target("avx2")))
+static inline void stencil_laplacian_row_avx2(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	const __m256i zero = _mm256_setzero_si256();
+	int y = y_begin;
+	for (; y + 32 <= y_end; y += 32) {
+		for (int half = 0; half < 32; half += 16) {
+			__m256i u = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(up + y + half)));
+			__m256i d = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(down + y + half)));
+			__m256i l = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(mid + y + half - 1)));
+			__m256i r = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(mid + y + half + 1)));
+			__m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(mid + y + half)));
+			__m256i sum = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(u, d), _mm256_add_epi16(l, r)), _mm256_slli_epi16(c, 2));
+			_mm256_storeu_si256((__m256i*)(out + y + half), _mm256_max_epi16(sum, zero));
+		}
+	}
+	stencil_laplacian_row_sse41(up, mid, down, out, y, y_end);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void stencil_laplacian_row_avx512(const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	const __m512i zero = _mm512_setzero_si512();
+	int y = y_begin;
+	for (; y + 64 <= y_end; y += 64) {
+		for (int half = 0; half < 64; half += 32) {
+			__m512i u = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(up + y + half)));
+			__m512i d = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(down + y + half)));
+			__m512i l = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(mid + y + half - 1)));
+			__m512i r = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(mid + y + half + 1)));
+			__m512i c = _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(mid + y + half)));
+			__m512i sum = _mm512_sub_epi16(_mm512_add_epi16(_mm512_add_epi16(u, d), _mm512_add_epi16(l, r)), _mm512_slli_epi16(c, 2));
+			_mm512_storeu_si512((void*)(out + y + half), _mm512_max_epi16(sum, zero));
+		}
+	}
+	stencil_laplacian_row_avx2(up, mid, down, out, y, y_end);
+}
+#endif
+
+/*
+	Pick the Laplacian kernel once. The best instruction set the CPU supports is used unless
+	STENCIL_ISA asks for a smaller one.
+*/
+static inline stencil_row_fn stencil_laplacian_kernel(void) {
+	static stencil_row_fn kernel = NULL;
+	if (kernel == NULL) {
+		stencil_row_fn chosen = stencil_laplacian_row;
+#ifdef STENCIL_X86
+		const char* isa = getenv("STENCIL_ISA");
+		int limit = 3;
+		if (isa != NULL) {
+			limit = strcmp(isa, "scalar") == 0 ? 0 : strcmp(isa, "sse41") == 0 ? 1 : strcmp(isa, "avx2") == 0 ? 2 : 3;
+		}
+		if (limit >= 3 && __builtin_cpu_supports("avx512bw")) {
+			chosen = stencil_laplacian_row_avx512;
+		}else if (limit >= 2 && __builtin_cpu_supports("avx2")) {
+			chosen = stencil_laplacian_row_avx2;
+		}else if (limit >= 1 && __builtin_cpu_supports("sse4.1")) {
+			chosen = stencil_laplacian_row_sse41;
+		}
+#endif
+		kernel = chosen;
+	}
+	return kernel;
+}
+
+//Name of the kernel stencil_laplacian_kernel picked, for the messages of the programs.
+static inline const char* stencil_kernel_name(void) {
+	stencil_row_fn kernel = stencil_laplacian_kernel();
+#ifdef STENCIL_X86
+	if (kernel == stencil_laplacian_row_avx512) {
+		return "avx512";
+	}
+	if (kernel == stencil_laplacian_row_avx2) {
+		return "avx2";
+	}
+	if (kernel == stencil_laplacian_row_sse41) {
+		return "sse41";
+	}
+#endif
+	(void)kernel;
+	return "scalar";
+}
+
+//Generic kernel for a mask that is only known at run time.
+static inline void stencil_generic_row(int h[3][3], const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	const unsigned char* rows[3] = { down, mid, up };
+	for (int y = y_begin; y < y_end; y++) {
+		int sum = 0;
+		for (int a = 0; a < 3; a++) {
+			for (int b = 0; b < 3; b++) {
+				sum += h[a][b] * rows[a][y + 1 - b];
+			}
+		}
+		out[y] = (short)(sum < 0 ? 0 : sum);
+	}
+}
+
+static inline int stencil_is_laplacian(int h[3][3]) {
+	return h[0][0] == 0 && h[0][1] == 1 && h[0][2] == 0 &&
+		h[1][0] == 1 && h[1][1] == -4 && h[1][2] == 1 &&
+		h[2][0] == 0 && h[2][1] == 1 && h[2][2] == 0;
+}
+
+//Row of the convolution with the mask h. The Laplacian goes to its specialized (and vectorized) kernel.
+static inline void stencil_row(int h[3][3], const unsigned char* up, const unsigned char* mid, const unsigned char* down, short* out, int y_begin, int y_end) {
+	if (stencil_is_laplacian(h)) {
+		stencil_laplacian_kernel()(up, mid, down, out, y_begin, y_end);
+	}else {
+		stencil_generic_row(h, up, mid, down, out, y_begin, y_end);
+	}
+}
+
+#endif
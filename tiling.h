@@ -0,0 +1,156 @@
+#ifndef TILING_H
+#define TILING_H
+
+/*
+	Cache-blocked traversal of the convolution.
+	The original loops walked the image column by column, so on a wide image every access of the
+	stencil landed in another cache line. The kernels of stencil.h already walk along the rows,
+	but a row of a wide image is still larger than the L1 cache: by the time the next output row
+	reads the same input row again, it has been pushed out. Here the rows are cut into tiles of
+	columns that are small enough for three input rows and one output row to stay in L1, and the
+	image is cut into bands of rows that are small enough for the gray rows and the results of a
+	band to stay in L2. The sizes of the caches are read from the system at run time.
+
+	The environment variables STENCIL_TILE_COLS and STENCIL_BAND_ROWS replace the computed sizes
+	(0 means no tiling in that direction), which is useful for comparisons.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "image_buffer.h"
+#include "stencil.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+//Sizes used when the system does not report its caches.
+#define TILING_DEFAULT_L1 (32 * 1024)
+#define TILING_DEFAULT_L2 (256 * 1024)
+
+typedef struct tile_plan {
+	long l1_bytes;		//Size of the L1 data cache.
+	long l2_bytes;		//Size of the L2 cache.
+	int tile_cols;		//Columns of a tile, a multiple of IMAGE_ALIGN.
+	int band_rows;		//Rows of a band.
+} tile_plan;
+
+#ifdef __linux__
+//Size of the data (or unified) cache of the given level from sysfs, 0 if it is not listed.
+static inline long tiling_sysfs_cache_size(int level) {
+	for (int index = 0; index < 16; index++) {
+		char path[96];
+		char type[32] = { 0 };
+		int found_level = 0;
+		long size = 0;
+		char unit = 0;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+		FILE* file = fopen(path, "r");
+		if (file == NULL) {
+			break;
+		}
+		int ok = fscanf(file, "%d", &found_level) == 1;
+		fclose(file);
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+		file = fopen(path, "r");
+		if (file != NULL) {
+			ok = ok && fscanf(file, "%31s", type) == 1;
+			fclose(file);
+		}
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		file = fopen(path, "r");
+		if (file != NULL) {
+			ok = ok && fscanf(file, "%ld%c", &size, &unit) >= 1;
+			fclose(file);
+		}
+
+		if (ok && found_level == level && type[0] != 'I') {
+			return unit == 'K' ? size * 1024 : unit == 'M' ? size * 1024 * 1024 : size;
+		}
+	}
+	return 0;
+}
+#endif
+
+//Size in bytes of the L1 data cache (level 1) or of the L2 cache (level 2).
+static inline long tiling_cache_size(int level) {
+	long size = 0;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+	size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+#endif
+#ifdef __linux__
+	if (size <= 0) {
+		size = tiling_sysfs_cache_size(level);
+	}
+#endif
+	if (size <= 0) {
+		size = level == 1 ? TILING_DEFAULT_L1 : TILING_DEFAULT_L2;
+	}
+	return size;
+}
+
+/*
+	Tile sizes for an image of the given width. A tile keeps three rows of gray values and one row
+	of 16-bit results, 5 bytes per column, in half of L1. A band keeps its gray rows and its results,
+	3 bytes per pixel, in half of L2. The other half is left for the mask, the stack and the output.
+*/
+static inline void tiling_plan(tile_plan* plan, int width) {
+	plan->l1_bytes = tiling_cache_size(1);
+	plan->l2_bytes = tiling_cache_size(2);
+
+	long cols = plan->l1_bytes / 2 / 5 / IMAGE_ALIGN * IMAGE_ALIGN;
+	plan->tile_cols = (int)(cols < IMAGE_ALIGN ? IMAGE_ALIGN : cols);
+	long rows = plan->l2_bytes / 2 / (3L * (width > 0 ? width : 1));
+	plan->band_rows = (int)(rows < 4 ? 4 : rows > 4096 ? 4096 : rows);
+
+	const char* value = getenv("STENCIL_TILE_COLS");
+	if (value != NULL) {
+		plan->tile_cols = atoi(value);
+	}
+	value = getenv("STENCIL_BAND_ROWS");
+	if (value != NULL) {
+		plan->band_rows = atoi(value);
+	}
+	/*
+		0 or less turns the tiling off in that direction. A forced tile width is rounded up to a multiple 
+		of IMAGE_ALIGN like the computed one, so that every tile starts on a cache line of the input and 
+		the output rows and two threads working on neighbouring tiles never write into the same line.
+	*/
+	if (plan->tile_cols > 0) {
+		plan->tile_cols = (int)image_round_up((size_t)plan->tile_cols, IMAGE_ALIGN);
+	}
+	if (plan->tile_cols <= 0 || plan->tile_cols > width) {
+		plan->tile_cols = width > 0 ? width : 1;
+	}
+	if (plan->band_rows <= 0) {
+		plan->band_rows = 1 << 30;
+	}
+}
+
+/*
+	Convolve the rows [row_begin, row_end) and the columns [col_begin, col_end) of in into out, one
+	band of rows and one tile of columns at a time. Inside a tile the rows are walked in order, so
+	the two input rows shared with the previous output row are still in L1. The tile edges are
+	multiples of the tile width, so the tiles start on cache lines. Like stencil_row the rows
+	row_begin - 1 and row_end of in must exist, and col_begin >= 1, col_end <= width - 1.
+*/
+static inline void stencil_tiled(int h[3][3], const image_buffer* in, const image_buffer* out, int row_begin, int row_end, int col_begin, int col_end, const tile_plan* plan) {
+	for (int band = row_begin; band < row_end; band += plan->band_rows) {
+		int band_end = row_end - band > plan->band_rows ? band + plan->band_rows : row_end;
+		for (int col = col_begin; col < col_end;) {
+			int tile_end = (col / plan->tile_cols + 1) * plan->tile_cols;
+			if (tile_end > col_end) {
+				tile_end = col_end;
+			}
+			for (int x = band; x < band_end; x++) {
+				stencil_row(h, image_row8(in, x - 1), image_row8(in, x), image_row8(in, x + 1), image_row16(out, x), col, tile_end);
+			}
+			col = tile_end;
+		}
+	}
+}
+
+#endif